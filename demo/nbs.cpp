@@ -1,4 +1,3 @@
-#include <exception>
 #define NBS_IMPLEMENTATION
 #include "../nbs.hpp"
 
@@ -6,33 +5,41 @@ using namespace std;
 using namespace nbs;
 using namespace nbs::os;
 using namespace nbs::str;
+using namespace nbs::async;
 
-int main(int argc, char **argv)
+Task<void> compile(Cmd cmd)
 {
-    self_update(argc, argv, __BASE_FILE__);
+    co_await cmd.async();
+}
 
+Task<void> build()
+{
     make_directory_if_not_exists("build");
 
     strvec sources{"App.cpp", "Csv.cpp", "CsvParser.cpp", "main.cpp", "sort.cpp"};
-    c::CompileOptions options{.compiler = c::GXX,
+    c::CompileOptions options{.compiler = c::Compiler::GXX,
                               .standard = "c++20",
                               .flags = {"-Wall", "-Wextra", "-pedantic", "-g"},
                               .include_paths = {path("include")}};
-    std::vector<Process> processes;
+    vector<Task<void>> compiles;
     pathvec objects;
     for (const auto &source : sources)
     {
         path input = path("src") / source;
         path output = path("build") / change_extension(source, "o");
-		auto run_result = options.obj_cmd(output, input).run_async();
-		objects.emplace_back(output);
-		if(run_result.is_ok())
-			processes.emplace_back(run_result.value());
-		else 
-			std::terminate();
+        compiles.emplace_back(compile(options.obj_cmd(output, input)));
+        objects.emplace_back(output);
     }
+    co_await when_all(std::move(compiles));
 
-    await_processes(processes);
     path exe("build/lab1");
-    c::CompileOptions{.compiler = c::GXX}.exe_cmd(exe, objects).run();
+    Cmd link = c::CompileOptions{.compiler = c::Compiler::GXX}.exe_cmd(exe, objects);
+    co_await link.async();
+}
+
+int main(int argc, char **argv)
+{
+    self_update(argc, argv, __BASE_FILE__);
+
+    run(build());
 }
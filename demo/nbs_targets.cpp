@@ -14,7 +14,7 @@ enum ConfType
     RELEASE
 };
 
-auto build(int argc, char **argv)
+bool build(int argc, char **argv)
 {
     log::info("Building");
 
@@ -35,7 +35,7 @@ auto build(int argc, char **argv)
 
     TargetMap targets;
     strvec sources{"App.cpp", "Csv.cpp", "CsvParser.cpp", "main.cpp", "sort.cpp"};
-    c::CompileOptions options{.compiler = c::GXX,
+    c::CompileOptions options{.compiler = c::Compiler::GXX,
                               .standard = "c++20",
                               .flags = {"-Wall", "-Wextra", "-pedantic"},
                               .include_paths = {path("include")}};
@@ -61,25 +61,33 @@ auto build(int argc, char **argv)
         path output = build_path / change_extension(source, "o");
         outputs.emplace_back(output);
         path input = path("src") / source;
-        Cmd cmd(options.obj_cmd(output, input));
-        Target target(output, cmd, {input});
+        Target target = options.obj_target(output, input);
         targets.insert(target);
     }
 
     path exe = build_path / "lab1";
-    Cmd exe_cmd = c::CompileOptions{.compiler = c::GXX}.exe_cmd(exe, outputs);
+    Cmd exe_cmd = c::CompileOptions{.compiler = c::Compiler::GXX}.exe_cmd(exe, outputs);
     Target exe_target(exe, exe_cmd, outputs);
     targets.insert(exe_target);
 
-    return targets.build_if_needs(exe);
+    try {
+        targets.build_if_needs(exe.buf);
+    } catch (BuildError e) {
+        log::error("Build failed");
+        return false;
+    }
+    return true;
 }
 
-auto run()
+bool run()
 {
-    auto result = Cmd("./build/debug/lab1").run();
-    if (result.is_err())
+    try {
+        Cmd("./build/debug/lab1").run();
+    } catch (os::ProcessError e) {
         log::error("Error running file");
-    return result;
+        return false;
+    }
+    return true;
 }
 
 int main(int argc, char **argv)
@@ -90,14 +98,13 @@ int main(int argc, char **argv)
 
     if (subcommand == "" || subcommand == "build")
     {
-        return build(argc, argv).is_err();
+        return !build(argc, argv);
     }
     else if (subcommand == "run")
     {
-        auto result = build(argc, argv);
-        if (result.is_err())
+        if (!build(argc, argv))
             return 1;
-        return run().is_err();
+        return !run();
     }
     else
     {
@@ -1,1239 +1,4965 @@
-/*
- * A simple build system to build in C++
- */
-
-/*
- * MIT License
- *
- * Copyright (c) 2024 Albert Shefner
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy
- * of this software and associated documentation files (the "Software"), to deal
- * in the Software without restriction, including without limitation the rights
- * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
- * copies of the Software, and to permit persons to whom the Software is
- * furnished to do so, subject to the following conditions:
- *
- * The above copyright notice and this permission notice shall be included in all
- * copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
- * SOFTWARE.
- */
-
-#ifndef NBS_HPP
-#define NBS_HPP
-
-#include <cassert>
-#include <ctime>
-
-#include <algorithm>
-#include <functional>
-#include <iostream>
-#include <sstream>
-#include <string>
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
-
-#ifdef _WIN32
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
-#else
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <unistd.h>
-#endif
-
-#if __cpp_exceptions
-	#define NBS_THROW(E) throw E
-#else
-	#define NBS_THROW(E) abort()
-#endif
-
-#ifndef NBSAPI
-#define NBSAPI
-#endif
-
-#define TODO(thing) assert(0 && thing "is not implemented.")
-
-// TODO: multiprocessed target building
-// TODO: generate targets in nbs::c
-// TODO: determine user toolchain (compiler, etc.)
-// TODO: support for MSVC syntax
-// TODO: CLI class for easy CLI app building
-// TODO: maybe nbs::unit for unit testing
-// TODO: nbs::config
-// TODO: cover nbs with tests
-// TODO: properly annotate
-// TODO: use string_view
-
-namespace nbs
-{
-typedef std::vector<std::string> strvec;
-
-NBSAPI void self_update(int argc, char **argv, const std::string &source);
-
-namespace os
-{
-struct Path {
-    std::string buf;
-
-    Path() = default;
-    Path(const std::string &str);
-    Path(const char *str);
-
-    Path &operator /=(const Path &other);
-    Path operator /(const Path &other) const;
-    Path &operator /=(const std::string &other);
-    Path operator /(const std::string &other) const;
-    Path &operator /=(const char *other);
-    Path operator /(const char *other) const;
-};
-
-using path = Path;
-
-enum ProcessError
-{
-    PROCESS_WAIT_ERROR,
-    PROCESS_EXIT_STATUS_ERROR,
-    PROCESS_EMPTY_CMD_ERROR,
-    PROCESS_CREATE_ERROR,
-#ifdef _WIN32
-    PROCESS_GET_EXIT_CODE_ERROR,
-    PROCESS_GET_HANDLE_ERROR,
-#else
-    PROCESS_SIGNAL_ERROR,
-    PROCESS_EXEC_ERROR,
-#endif
-};
-
-struct Process
-{
-#ifdef _WIN32
-    HANDLE handle;
-    Process(HANDLE handle);
-#else
-    int pid;
-    Process(int pid);
-#endif
-    void await() const;
-};
-
-struct Cmd
-{
-    strvec items;
-
-    Cmd();
-    Cmd(const std::string &cmd);
-    Cmd(const std::initializer_list<std::string> &cmd);
-
-    void append(const std::string &item);
-    void append_many(const strvec &items);
-    void append_many_prefixed(const std::string &prefix, const strvec &items);
-
-    std::string to_string() const;
-    void run() const;
-    Process run_async() const;
-    void run_or_die(const std::string &message) const;
-    std::unique_ptr<char *[]> to_c_argv() const;
-};
-
-NBSAPI void await_processes(const std::vector<Process> &processes);
-
-#ifdef _WIN32
-std::string windows_error_code_to_str(DWORD error);
-std::string windows_last_error_str();
-#endif
-
-typedef std::vector<path> pathvec;
-
-NBSAPI strvec paths_to_strs(const pathvec &paths);
-NBSAPI pathvec strs_to_paths(const strvec &paths);
-NBSAPI long compare_last_mod_time(const path &path1, const path &path2);
-NBSAPI bool make_directory_if_not_exists(const path &path);
-NBSAPI bool exists(const path &path);
-NBSAPI void rename(const os::path &from, const path &to);
-NBSAPI long last_write_time(const os::path &path);
-} // namespace os
-
-namespace str
-{
-NBSAPI std::string join(const std::string &sep, const strvec &strings);
-NBSAPI std::string trim_to(const std::string &str, const std::string &chars = "\n\r ");
-NBSAPI std::string trim_right_to(const std::string &str, const std::string &chars = "\n\r ");
-NBSAPI std::string trim_left_to(const std::string &str, const std::string &chars = "\n\r ");
-NBSAPI strvec split(const std::string &str, const std::string &delim);
-NBSAPI std::string change_extension(const std::string &file, const std::string &new_extension);
-} // namespace str
-
-namespace log
-{
-enum LogLevel
-{
-    Info = 0,
-    Warning = 1,
-    Error = 2,
-};
-
-NBSAPI std::string log_level_str(LogLevel level);
-NBSAPI void log(LogLevel level, const std::string &message);
-NBSAPI void info(const std::string &message);
-NBSAPI void warning(const std::string &message);
-NBSAPI void error(const std::string &message);
-} // namespace log
-
-namespace graph
-{
-template <typename T>
-using Edges = std::unordered_set<T>;
-
-template <typename T>
-using Graph = std::unordered_map<T, Edges<T>>;
-
-enum GraphError
-{
-    CycleDependency,
-    VertexNotFound
-};
-
-template <typename T>
-NBSAPI std::unordered_set<T> find_roots(const Graph<T> &graph);
-
-template <typename T>
-NBSAPI std::vector<std::vector<T>> topological_levels(
-    const Graph<T> &graph, const Edges<T> &roots);
-} // namespace graph
-
-namespace target
-{
-enum BuildError
-{
-    BUILD_CMD_ERROR,
-    BUILD_NO_RULE_FOR_TARGET_ERROR,
-    BUILD_CYCLE_DEPENDENCY_ERROR,
-};
-
-struct Target
-{
-    os::path output;
-    std::vector<os::Cmd> cmds;
-    os::pathvec dependencies;
-
-    Target(const os::path &output, const os::Cmd &cmd, const os::pathvec &dependencies = {});
-    Target(const os::path &output, const std::vector<os::Cmd> &cmds, const os::pathvec &dependencies = {});
-
-    void build() const;
-};
-
-struct TargetMap
-{
-    std::unordered_map<std::string, Target> targets;
-
-    TargetMap() = default;
-
-    void insert(Target &target);
-    bool remove(const std::string &target);
-    void build(const std::string &output) const;
-    void build_if_needs(const std::string &output) const;
-    bool needs_rebuild(const os::path &output) const;
-};
-} // namespace target
-
-namespace c
-{
-enum class Compiler
-{
-    CC,
-    CXX,
-    GCC,
-    GXX,
-    CLANG,
-    CLANGXX,
-    MSVC,
-};
-
-struct CDefaults
-{
-    Compiler compiler = Compiler::CXX;
-    std::string standard;
-    strvec flags;
-    os::pathvec include_paths;
-    os::pathvec libs;
-    os::pathvec lib_paths;
-    strvec defines;
-    strvec other_flags;
-};
-
-NBSAPI CDefaults *get_cdefaults();
-struct CompileOptions
-{
-    Compiler compiler = get_cdefaults()->compiler;
-    std::string standard = get_cdefaults()->standard;
-    strvec flags = get_cdefaults()->flags;
-    os::pathvec include_paths = get_cdefaults()->include_paths;
-    os::pathvec libs = get_cdefaults()->libs;
-    os::pathvec lib_paths = get_cdefaults()->lib_paths;
-    strvec defines = get_cdefaults()->defines;
-    strvec other_flags = get_cdefaults()->other_flags;
-
-    os::Cmd cmd(const os::pathvec &sources, const strvec &additional_flags = {}) const;
-    os::Cmd exe_cmd(const os::path &output, const os::pathvec &sources) const;
-    os::Cmd obj_cmd(const os::path &output, const os::path &source) const;
-    os::Cmd static_lib_cmd(const os::path &output, const os::pathvec &sources) const;
-    os::Cmd dynamic_lib_cmd(const os::pathvec &sources) const; // TODO
-};
-
-NBSAPI std::string comp_str(Compiler comp);
-NBSAPI Compiler current_compiler();
-
-}; // namespace c
-
-namespace wget {
-enum class WgetBackend {
-    Wget,
-    Curl,
-    PowerShell,
-};
-
-void make_available(const os::path &path, const std::string &url, WgetBackend backend = WgetBackend::Curl);
-}; // namespace wget
-
-namespace vcpkg
-{
-struct TargetTriplet {
-    std::string triplet;
-    bool is_static;
-
-    std::string to_string() const;
-};
-
-struct Vcpkg {
-    TargetTriplet triplet;
-    nbs::os::path root;
-
-    Vcpkg();
-
-    Vcpkg &with_triplet(const std::string &triplet);
-    Vcpkg &with_root(const nbs::os::path &path);
-    nbs::os::pathvec include_paths() const;
-    nbs::os::pathvec library_paths() const;
-
-    void install() const;
-};
-}; // namespace vcpkg
-}; // namespace nbs
-
-// -------------------------------
-//
-//        Implementation
-//
-// -------------------------------
-
-#ifdef NBS_IMPLEMENTATION
-
-namespace nbs
-{
-NBSAPI void self_update(int argc, char **argv, const std::string &source)
-{
-    assert(argc > 0);
-    std::string exe(argv[0]);
-
-    if (os::compare_last_mod_time(source, exe) < 0) return;
-
-    log::info("Updating");
-    log::info("Renaming " + exe + " to " + exe + ".old");
-    os::rename(exe, exe + ".old");
-
-    os::Cmd compile_cmd;
-    compile_cmd.append_many({c::comp_str(c::current_compiler()), source});
-#if defined(_MSC_VER) && !defined(__clang__)
-    compile_cmd.append_many({"-Fe:" + exe, "-FC", "-EHsc", "-nologo"});
-#else
-    compile_cmd.append_many({"-o", exe});
-#endif
-    compile_cmd.run_or_die("Error during self_update!!!");
-
-    os::Cmd exe_cmd(exe);
-    for (int i = 1; i < argc; i++)
-    {
-        exe_cmd.append(argv[i]);
-    }
-    exe_cmd.run();
-
-    exit(0);
-}
-
-namespace os
-{
-Path::Path(const std::string &str) : buf(str) {}
-Path::Path(const char *str) : buf(str) {}
-
-// TODO: Windows...
-Path &Path::operator /=(const Path &other) {
-    if (this->buf.back() != '/') {
-        this->buf.push_back('/');
-    }
-
-    auto iter = other.buf.begin();
-    if (*iter == '/') {
-        iter++;
-    }
-
-    this->buf.append(iter, other.buf.end());
-
-    return *this;
-}
-
-Path Path::operator /(const Path &other) const {
-    return Path(*this) /= other;
-}
-
-Path &Path::operator /=(const std::string &other) {
-    return *this /= Path(other);
-}
-
-Path Path::operator /(const std::string &other) const {
-    return *this / Path(other);
-}
-
-Path &Path::operator /=(const char *other) {
-    return *this /= Path(other);
-}
-
-Path Path::operator /(const char *other) const {
-    return *this / Path(other);
-}
-
-#ifdef _WIN32
-Process::Process(HANDLE handle)
-    : handle(handle)
-{
-}
-#else
-Process::Process(int pid)
-    : pid(pid)
-{
-}
-#endif
-
-void Process::await() const
-{
-#ifdef _WIN32
-    DWORD result = WaitForSingleObject(handle, INFINITE);
-
-    if (result == WAIT_FAILED)
-    {
-        log::error(os::windows_last_error_str());
-        // TODO: Error
-        throw PROCESS_WAIT_ERROR;
-    }
-
-    DWORD exit_status;
-    // TODO: Error
-    if (!GetExitCodeProcess(handle, &exit_status)) throw PROCESS_GET_EXIT_CODE_ERROR;
-
-    // TODO: Error
-    if (exit_status != 0) throw PROCESS_EXIT_STATUS_ERROR;
-
-    CloseHandle(handle);
-#else
-    while (true)
-    {
-        int status = 0;
-        if (waitpid(pid, &status, 0) < 0)
-        {
-            // TODO: Error
-            throw PROCESS_WAIT_ERROR;
-        }
-
-        if (WIFEXITED(status))
-        {
-            int exit_status = WEXITSTATUS(status);
-            if (exit_status == 0) return;
-            // TODO: Error
-            else throw PROCESS_EXIT_STATUS_ERROR;
-        }
-
-        // TODO: Error
-        if (WIFSIGNALED(status)) throw PROCESS_WAIT_ERROR;
-    }
-#endif
-}
-
-NBSAPI void await_processes(const std::vector<Process> &processes)
-{
-    for (const auto &proc : processes)
-    {
-        proc.await();
-    }
-}
-
-Cmd::Cmd()
-{
-}
-
-Cmd::Cmd(const std::string &cmd)
-{
-    append(cmd);
-}
-
-Cmd::Cmd(const std::initializer_list<std::string> &cmd)
-{
-    append_many(cmd);
-}
-
-void Cmd::append(const std::string &item)
-{
-    items.emplace_back(item);
-}
-
-void Cmd::append_many(const strvec &items)
-{
-    for (auto item : items)
-    {
-        append(item);
-    }
-}
-
-void Cmd::append_many_prefixed(const std::string &prefix, const strvec &items)
-{
-    for (auto item : items)
-    {
-        append(prefix + item);
-    }
-}
-
-std::string Cmd::to_string() const
-{
-    // TODO: escape item
-    if (items.empty())
-        return "";
-
-    std::stringstream ss;
-    for (size_t i = 0; i < items.size() - 1; i++)
-    {
-        ss << items[i] << " ";
-    }
-    ss << items[items.size() - 1];
-
-    return ss.str();
-}
-
-void Cmd::run() const
-{
-    run_async().await();
-}
-
-Process Cmd::run_async() const
-{
-    // TODO: Error
-    if (items.empty()) throw PROCESS_EMPTY_CMD_ERROR;
-
-    std::string args_str = to_string();
-    log::info("CMD: " + args_str);
-
-#ifdef _WIN32
-    char *args = (char *)args_str.c_str(); // TODO: Proper Cmd.to_string
-    STARTUPINFO startupinfo;
-    ZeroMemory(&startupinfo, sizeof(startupinfo));
-    startupinfo.cb = sizeof(startupinfo);
-
-    startupinfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-    // TODO: Error
-    if (startupinfo.hStdInput == INVALID_HANDLE_VALUE) throw PROCESS_GET_HANDLE_ERROR;
-
-    startupinfo.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
-    // TODO: Error
-    if (startupinfo.hStdOutput == INVALID_HANDLE_VALUE) throw PROCESS_GET_HANDLE_ERROR;
-
-    startupinfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-    // TODO: Error
-    if (startupinfo.hStdError == INVALID_HANDLE_VALUE) throw PROCESS_GET_HANDLE_ERROR;
-
-    startupinfo.dwFlags |= STARTF_USESTDHANDLES;
-
-    PROCESS_INFORMATION process_info;
-    ZeroMemory(&process_info, sizeof(process_info));
-
-    BOOL success = CreateProcessA(NULL, args, NULL, NULL, TRUE, 0, NULL, NULL, &startupinfo, &process_info);
-    // TODO: Error
-    if (!success) throw PROCESS_CREATE_ERROR;
-
-    CloseHandle(process_info.hThread);
-
-    return process_info.hProcess;
-#else
-    int p = fork();
-    if (p < 0) throw PROCESS_CREATE_ERROR;
-    else if (p == 0)
-    {
-        auto args = to_c_argv();
-        execvp(args[0], args.get());
-        throw PROCESS_EXEC_ERROR;
-    }
-    return p;
-#endif
-}
-
-void Cmd::run_or_die(const std::string &message) const
-{
-    try {
-        run();
-    // TODO: Error
-    } catch (int) {
-        nbs::log::error(message);
-        exit(1);
-    }
-}
-
-std::unique_ptr<char *[]> Cmd::to_c_argv() const
-{
-    auto result = std::make_unique<char *[]>(items.size() + 1);
-    for (size_t i = 0; i < items.size(); i++)
-    {
-        result[i] = (char *)items[i].c_str();
-    }
-    result[items.size()] = NULL;
-    return result;
-}
-
-#ifdef _WIN32
-std::string windows_error_code_to_str(DWORD error)
-{
-    // https://stackoverflow.com/questions/1387064/how-to-get-the-error-message-from-the-error-code-returned-by-getlasterror
-
-    LPSTR messageBuffer = nullptr;
-
-    DWORD size = FormatMessage(
-        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, nullptr, error,
-        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), reinterpret_cast<LPSTR>(&messageBuffer), 0, nullptr);
-
-    return messageBuffer;
-}
-
-std::string windows_last_error_str()
-{
-    DWORD error = GetLastError();
-    return windows_error_code_to_str(error);
-}
-#endif
-
-NBSAPI strvec paths_to_strs(const pathvec &paths)
-{
-    strvec result;
-    for (const path &path : paths)
-    {
-        result.push_back(path.buf);
-    }
-    return result;
-}
-
-NBSAPI pathvec strs_to_paths(const strvec &paths)
-{
-    size_t size = paths.size();
-    pathvec result(size);
-    std::copy_n(paths.begin(), size, result.begin());
-    return result;
-}
-
-NBSAPI long compare_last_mod_time(const path &path1, const path &path2)
-{
-    long time1 = os::last_write_time(path1);
-    long time2 = os::last_write_time(path2);
-    return time1 - time2;
-}
-
-NBSAPI bool make_directory_if_not_exists(const path &path)
-{
-#if _WIN32
-    // TODO: Error handling
-    CreateDirectory(path.buf.c_str(), NULL);
-    return true;
-#else
-    if (exists(path)) {
-        return true;
-    }
-
-    return mkdir(path.buf.c_str(), 0777) == 0;
-#endif
-}
-
-NBSAPI bool exists(const path &path)
-{
-    struct stat st{};
-    return stat(path.buf.c_str(), &st) == 0;
-}
-
-NBSAPI void rename(const os::path &from, const path &to) {
-#if _WIN32
-    MoveFileEx(from.buf.c_str(), to.buf.c_str(), MOVEFILE_REPLACE_EXISTING);
-#else
-    // TODO: Error handling
-    int ret = std::rename(from.buf.c_str(), to.buf.c_str());
-    if (ret != 0) throw "Could not rename directory";
-#endif
-}
-
-NBSAPI long last_write_time(const os::path &path) {
-#if _WIN32
-    const int64_t WINDOWS_TICK = 10000000;
-    const int64_t SEC_TO_UNIX_EPOCH = 11644473600LL;
-
-    HANDLE hfile = CreateFile(
-        path.buf.c_str(),
-        GENERIC_READ,
-        FILE_SHARE_READ|FILE_SHARE_WRITE,
-        NULL,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
-    FILETIME last_write;
-    // TODO: Error handling
-    GetFileTime(hfile, NULL, NULL, &last_write);
-    int64_t val = *(int64_t *) &last_write;
-    val = val / WINDOWS_TICK - SEC_TO_UNIX_EPOCH;
-    CloseHandle(hfile);
-    return val;
-#else
-    struct stat st{};
-    stat(path.buf.c_str(), &st);
-    return st.st_ctimespec.tv_sec;
-#endif
-}
-} // namespace os
-
-namespace str
-{
-NBSAPI std::string join(const std::string &sep, const strvec &strings)
-{
-    if (strings.empty())
-        return "";
-
-    if (strings.size() == 1)
-        return strings[0];
-
-    std::stringstream ss;
-    for (size_t i = 0; i < strings.size() - 1; i++)
-    {
-        ss << strings[i];
-        ss << sep;
-    }
-    ss << strings.back();
-
-    return ss.str();
-}
-
-NBSAPI std::string trim_to(const std::string &str, const std::string &chars)
-{
-    return trim_right_to(trim_left_to(str), chars);
-}
-
-NBSAPI std::string trim_right_to(const std::string &str, const std::string &chars)
-{
-    size_t count = str.size();
-    while (count > 0 && chars.find(str[count - 1]) == std::string::npos)
-    {
-        count--;
-    }
-    return str.substr(0, count);
-}
-
-NBSAPI std::string trim_left_to(const std::string &str, const std::string &chars)
-{
-    size_t index = 0;
-    while (index < str.size() && chars.find(str[index]) == std::string::npos)
-    {
-        index++;
-    }
-    return str.substr(index);
-}
-
-NBSAPI strvec split(const std::string &str, const std::string &delim)
-{
-    if (str.empty())
-        return {""};
-
-    strvec result;
-    size_t index = 0;
-    size_t count = 0;
-
-    for (size_t i = 0; i < str.size(); i++)
-    {
-        char c = str[i];
-        if (delim.find(c) == std::string::npos)
-        {
-            count++;
-        }
-        else
-        {
-            result.emplace_back(str.substr(index, count));
-            index = i + 1;
-            count = 0;
-        }
-    }
-    result.emplace_back(str.substr(index, count));
-
-    return result;
-}
-
-NBSAPI std::string change_extension(const std::string &file, const std::string &new_extension)
-{
-    return trim_right_to(file, ".") + new_extension;
-}
-} // namespace str
-
-namespace log
-{
-static LogLevel minimal_level = Info;
-
-NBSAPI std::string log_level_str(LogLevel level)
-{
-    switch (level)
-    {
-    case Info:
-        return "INFO";
-    case Warning:
-        return "WARNING";
-    case Error:
-        return "ERROR";
-    default:
-        return "UNKNOWN LOG LEVEL";
-    }
-}
-
-NBSAPI void log(LogLevel level, const std::string &message)
-{
-    if (level < minimal_level)
-        return;
-
-    (level == Info ? std::cout : std::cerr) << '[' << log_level_str(level) << "] " << message << '\n';
-}
-
-NBSAPI void info(const std::string &message)
-{
-    log(Info, message);
-}
-
-NBSAPI void warning(const std::string &message)
-{
-    log(Warning, message);
-}
-
-NBSAPI void error(const std::string &message)
-{
-    log(Error, message);
-}
-
-} // namespace log
-
-namespace graph
-{
-template <typename T>
-NBSAPI std::unordered_set<T> find_roots(const Graph<T> &graph)
-{
-    std::unordered_set<T> result;
-
-    for (const auto &pair : graph)
-    {
-        result.insert(pair.first);
-    }
-
-    for (const auto &pair : graph)
-    {
-        for (const auto &vertex : pair.second)
-        {
-            result.erase(vertex);
-        }
-    }
-
-    return result;
-}
-
-template <typename T>
-NBSAPI std::vector<std::vector<T>> topological_levels(
-    const Graph<T> &graph, const Edges<T> &roots
-) {
-    struct Vertex
-    {
-        const T &name;
-        const std::unordered_set<T> &edges;
-        ptrdiff_t level;
-        bool has_level;
-        bool traversing;
-
-        Vertex(const T &name, const Edges<T> &edges)
-            : name(name), edges(edges), level(0), has_level(false), traversing(false)
-        {
-        }
-        Vertex(const T &name, const Edges<T> &edges, ptrdiff_t level, bool has_level)
-            : name(name), edges(edges), level(level), has_level(has_level), traversing(false)
-        {
-        }
-    };
-
-    std::unordered_map<T, Vertex> vertices;
-    for (const auto &pair : graph)
-    {
-        vertices.insert({pair.first, Vertex(pair.first, pair.second)});
-    }
-
-    ptrdiff_t max_level = 0;
-	
-    std::function<void(Vertex &, ptrdiff_t)> do_search =
-        [&](Vertex &vertex, ptrdiff_t level) -> void {
-            if (vertex.traversing) throw CycleDependency;
-
-            vertex.traversing = true;
-
-            ptrdiff_t v_level = vertex.has_level ? vertex.level : -1;
-            if (v_level <= level) {
-                vertex.level = level;
-                vertex.has_level = true;
-            }
-
-            for (const T &edge : vertex.edges)
-            {
-                auto vertex_search = vertices.find(edge);
-                if (vertex_search == vertices.end()) throw VertexNotFound;
-                Vertex &v = vertex_search->second;
-
-				do_search(v, level + 1);
-            }
-
-            vertex.traversing = false;
-
-            if (level > max_level)
-                max_level = level;
-        };
-
-    Vertex root("", roots);
-
-	do_search(root, -1);
-
-    std::vector<std::vector<T>> result(max_level + 1);
-
-    for (const auto &v : vertices)
-    {
-        if (!v.second.has_level) continue;
-        if (v.second.level < 0) continue;
-
-        result[v.second.level].emplace_back(v.first);
-    }
-
-    return result;
-}
-} // namespace graph
-
-namespace target
-{
-Target::Target(const os::path &output, const os::Cmd &cmd, const os::pathvec &dependencies)
-    : output(output), cmds({cmd}), dependencies(dependencies)
-{
-}
-Target::Target(const os::path &output, const std::vector<os::Cmd> &cmds, const os::pathvec &dependencies)
-    : output(output), cmds(cmds), dependencies(dependencies)
-{
-}
-
-void Target::build() const
-{
-    for (const auto &cmd : cmds)
-    {
-        cmd.run();
-    }
-}
-
-void TargetMap::insert(Target &target)
-{
-    targets.insert({target.output.buf, target});
-}
-
-bool TargetMap::remove(const std::string &target_output)
-{
-    return targets.erase(target_output) > 0;
-}
-
-void TargetMap::build(const std::string &output) const
-{
-    auto target_it = targets.find(output);
-    if (target_it == targets.end()) throw BUILD_NO_RULE_FOR_TARGET_ERROR;
-    auto target = target_it->second;
-
-    for (const auto &dep : target.dependencies)
-    {
-        if (os::exists(dep))
-            continue;
-
-        build(dep.buf);
-    }
-
-    target.build();
-}
-
-void TargetMap::build_if_needs(const std::string &output) const
-{
-    if (!needs_rebuild(output)) return;
-
-    auto target = targets.find(output)->second; // TODO: error handling
-    graph::Graph<std::string> graph;
-    for (const auto &p : targets)
-    {
-        graph::Edges<std::string> edges;
-        for (const auto &e : p.second.dependencies)
-        {
-            edges.insert(e.buf);
-            graph[e.buf];
-        }
-        graph[p.first] = edges;
-    }
-
-    std::vector<std::vector<std::string>> levels;
-    try {
-        levels = graph::topological_levels<std::string>(graph, {target.output.buf});
-    } catch (graph::GraphError e) {
-        switch (e)
-        {
-        case graph::CycleDependency:
-            throw BUILD_CYCLE_DEPENDENCY_ERROR;
-        case graph::VertexNotFound:
-            throw BUILD_NO_RULE_FOR_TARGET_ERROR;
-        default:
-            assert(0 && "Unreachable");
-        }
-    }
-
-    for (ptrdiff_t i = levels.size() - 1; i >= 0; i--)
-    {
-        std::vector<os::Process> processes;
-        for (const auto &t_name : levels[i])
-        {
-            auto t_search = targets.find(t_name); 
-            if (t_search != targets.end())
-            {
-                if (!needs_rebuild(t_name))
-                    continue;
-                auto t = t_search->second;
-                try {
-                    os::Process p = t.cmds[0].run_async();
-                    processes.emplace_back(p); // TODO: multiple commands
-                } catch (os::ProcessError e) {
-                    throw BUILD_CMD_ERROR;
-                }
-            }
-            else if (!os::exists(t_name)) throw BUILD_NO_RULE_FOR_TARGET_ERROR;
-        }
-
-        try {
-            await_processes(processes);
-        } catch (os::ProcessError e) {
-            throw BUILD_CMD_ERROR;
-        }
-    }
-}
-
-bool TargetMap::needs_rebuild(const os::path &output) const
-{
-    if (!os::exists(output)) return true;
-
-    auto target_it = targets.find(output.buf);
-    if (target_it == targets.end())
-        TODO("needs_rebuild error handling");
-    auto target = target_it->second;
-
-    for (const auto &dep : target.dependencies)
-    {
-        if (((targets.find(dep.buf) != targets.end()) && needs_rebuild(dep)) ||
-            (((targets.find(dep.buf) != targets.end()) && !os::exists(dep)) ||
-             (os::exists(dep) && (os::compare_last_mod_time(output, dep) < 0))))
-        {
-            return true;
-        }
-    }
-    return false;
-}
-} // namespace target
-
-namespace c {
-static CDefaults cdefaults;
-
-NBSAPI std::string comp_str(Compiler comp)
-{
-    switch (comp)
-    {
-    case Compiler::CC:
-        return "cc";
-    case Compiler::CXX:
-        return "c++";
-    case Compiler::GCC:
-        return "gcc";
-    case Compiler::GXX:
-        return "g++";
-    case Compiler::CLANG:
-        return "clang";
-    case Compiler::CLANGXX:
-        return "clang++";
-    case Compiler::MSVC:
-        return "cl.exe";
-    default:
-        return "UNKNOWN COMPILER";
-    }
-}
-
-NBSAPI Compiler current_compiler()
-{
-//  Clang C++ emulates GCC, so it has to appear early.
-#if defined __clang__ && !defined(__ibmxl__) && !defined(__CODEGEARC__)
-    return Compiler::CLANGXX;
-
-// MINGW32
-#elif defined(__MINGW32__)
-    TODO("mingw")
-
-//  GNU C++:
-#elif defined(__GNUC__) && !defined(__ibmxl__)
-    return GXX;
-
-//  Microsoft Visual C++
-#elif defined _MSC_VER
-    return MSVC;
-#endif
-
-    TODO("Unknown compiler");
-}
-
-NBSAPI CDefaults *get_cdefaults()
-{
-    return &cdefaults;
-}
-
-os::Cmd CompileOptions::cmd(const os::pathvec &sources, const strvec &additional_flags) const
-{
-    // TODO: fucking windows pain
-    os::Cmd cmd;
-
-    cmd.append(comp_str(compiler));
-    if (!standard.empty())
-        cmd.append("-std=" + standard);
-
-    cmd.append_many(additional_flags);
-
-    cmd.append_many(flags);
-    cmd.append_many_prefixed("-I", os::paths_to_strs(include_paths));
-    cmd.append_many_prefixed("-D", defines);
-    cmd.append_many(other_flags);
-
-    cmd.append_many(os::paths_to_strs(sources));
-
-    cmd.append_many_prefixed("-L", os::paths_to_strs(lib_paths));
-    cmd.append_many_prefixed("-l", os::paths_to_strs(libs));
-
-    return cmd;
-}
-
-os::Cmd CompileOptions::exe_cmd(const os::path &output, const os::pathvec &sources) const
-{
-    strvec additional_flags;
-    if (compiler == Compiler::MSVC)
-    {
-        additional_flags.emplace_back("-Fe:" + output.buf);
-    }
-    else
-    {
-        additional_flags.emplace_back("-o");
-        additional_flags.emplace_back(output.buf);
-    }
-
-    return this->cmd(sources, additional_flags);
-}
-
-os::Cmd CompileOptions::obj_cmd(const os::path &output, const os::path &source) const
-{
-    strvec additional_flags;
-    additional_flags.emplace_back("-c");
-    if (compiler == Compiler::MSVC)
-    {
-        additional_flags.emplace_back("-Fo:" + output.buf);
-    }
-    else
-    {
-        additional_flags.emplace_back("-o");
-        additional_flags.emplace_back(output.buf);
-    }
-    return this->cmd({source}, additional_flags);
-}
-
-os::Cmd CompileOptions::static_lib_cmd(const os::path &output, const os::pathvec &objects) const
-{
-    os::Cmd cmd({"ar", "r", output.buf});
-    cmd.append_many(os::paths_to_strs(objects));
-    return cmd;
-}
-} // namespace c
-
-namespace wget {
-void make_available(const os::path &path, const std::string &url, WgetBackend backend) {
-    if (exists(path)) return;
-
-    switch (backend) {
-        case WgetBackend::Wget: {
-            TODO("download with Curl");
-        } break;
-
-        case WgetBackend::Curl: {
-            auto cmd = os::Cmd({"curl", "-L", "-o", path.buf, url});
-            cmd.run();
-        } break;
-
-        case WgetBackend::PowerShell: {
-            TODO("download with PowerShell");
-        } break;
-    }
-}
-} // namespace wget
-
-namespace vcpkg {
-std::string TargetTriplet::to_string() const {
-    return triplet;
-}
-
-Vcpkg::Vcpkg() : root("vcpkg_installed") {}
-
-Vcpkg &Vcpkg::with_triplet(const std::string &triplet) {
-    bool is_static = triplet.find("-static") != std::string::npos;
-    this->triplet = TargetTriplet { triplet, is_static };
-    return *this;
-}
-
-Vcpkg &Vcpkg::with_root(const nbs::os::path &path) {
-    this->root = path;
-    return *this;
-}
-
-nbs::os::pathvec Vcpkg::include_paths() const {
-    return { root / triplet.to_string() / "include" };
-}
-
-nbs::os::pathvec Vcpkg::library_paths() const {
-    return { root / triplet.to_string() / "lib" };
-}
-
-void Vcpkg::install() const {
-    nbs::os::Cmd({
-        "vcpkg", "install",
-        "--triplet=" + triplet.to_string(),
-        "--vcpkg-root=" + root.buf,
-    }).run();
-}
-} // namespace vcpkg
-} // namespace nbs
-
-#endif // NBS_IMPLEMENTATION
-#endif // NBS_HPP
+/*
+ * A simple build system to build in C++
+ */
+
+/*
+ * MIT License
+ *
+ * Copyright (c) 2024 Albert Shefner
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef NBS_HPP
+#define NBS_HPP
+
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if __cpp_impl_coroutine
+#include <coroutine>
+#include <exception>
+#include <optional>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#if defined(__APPLE__) || (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)))
+#define NBS_SPAWN_CHDIR 1
+#endif
+#endif
+
+#if __cpp_exceptions
+	#define NBS_THROW(E) throw E
+#else
+	#define NBS_THROW(E) abort()
+#endif
+
+#ifndef NBSAPI
+#define NBSAPI
+#endif
+
+#define TODO(thing) assert(0 && thing "is not implemented.")
+
+// TODO: generate targets in nbs::c
+// TODO: determine user toolchain (compiler, etc.)
+// TODO: support for MSVC syntax
+// TODO: CLI class for easy CLI app building
+// TODO: maybe nbs::unit for unit testing
+// TODO: nbs::config
+// TODO: cover nbs with tests
+// TODO: properly annotate
+// TODO: use string_view
+
+namespace nbs
+{
+typedef std::vector<std::string> strvec;
+
+NBSAPI void self_update(int argc, char **argv, const std::string &source);
+
+#if __cpp_impl_coroutine
+namespace async
+{
+struct CmdAwaiter;
+} // namespace async
+#endif
+
+namespace os
+{
+struct Path {
+    std::string buf;
+
+    Path() = default;
+    Path(const std::string &str);
+    Path(const char *str);
+
+    Path &operator /=(const Path &other);
+    Path operator /(const Path &other) const;
+    Path &operator /=(const std::string &other);
+    Path operator /(const std::string &other) const;
+    Path &operator /=(const char *other);
+    Path operator /(const char *other) const;
+};
+
+using path = Path;
+
+enum ProcessError
+{
+    PROCESS_WAIT_ERROR,
+    PROCESS_EXIT_STATUS_ERROR,
+    PROCESS_EMPTY_CMD_ERROR,
+    PROCESS_CREATE_ERROR,
+#ifdef _WIN32
+    PROCESS_GET_EXIT_CODE_ERROR,
+    PROCESS_GET_HANDLE_ERROR,
+#else
+    PROCESS_SIGNAL_ERROR,
+    PROCESS_EXEC_ERROR,
+#endif
+};
+
+enum FileError
+{
+    FILE_RENAME_ERROR,
+    FILE_WRITE_ERROR,
+};
+
+struct Process
+{
+#ifdef _WIN32
+    HANDLE handle;
+    HANDLE output = NULL; // read end of the captured output, if any
+    HANDLE job = NULL;    // job object holding it and its children, see Cmd::new_group
+    Process(HANDLE handle);
+#else
+    int pid;
+    int output = -1;    // non-blocking read end of the captured output, if any
+    bool group = false; // leads its own process group, see Cmd::new_group
+    Process(int pid);
+#endif
+    void await() const;
+    void terminate() const; // with its children if it has its own group
+    bool operator ==(const Process &other) const;
+};
+
+struct ProcessStatus
+{
+    Process process;
+    int exit_code;
+    bool signaled;
+    uint64_t cpu_time_us = 0; // user + system
+    uint64_t max_rss = 0;     // peak resident set size in bytes
+    std::string output = "";  // captured output, see Capture
+
+    bool success() const;
+};
+
+// Reaps whichever process of the group exits first, so callers can reuse
+// its slot right away instead of waiting in start order.
+struct ProcessGroup
+{
+    std::vector<Process> processes;
+#ifdef _WIN32
+    std::unordered_map<HANDLE, std::string> outputs; // captured so far, by process handle
+#else
+    std::unordered_map<int, std::string> outputs; // captured so far, by pid
+    std::unordered_map<int, int> pidfds;          // by pid, where pidfd_open works
+#endif
+
+    ProcessGroup() = default;
+    ProcessGroup(const ProcessGroup &) = delete;
+    ProcessGroup &operator =(const ProcessGroup &) = delete;
+    ~ProcessGroup();
+
+    void add(const Process &process);
+    size_t size() const;
+    bool empty() const;
+    bool any_exited() const; // wait_any() would not block
+    ProcessStatus wait_any();
+};
+
+enum class SpawnBackend
+{
+    PosixSpawn,
+    Fork,
+};
+
+NBSAPI void set_spawn_backend(SpawnBackend backend);
+
+enum class Capture
+{
+    None,   // the child inherits our stdout and stderr
+    Stdout, // stdout goes to Process::output
+    All,    // stdout and stderr go to Process::output, interleaved as written
+};
+
+struct Cmd
+{
+    strvec items;
+    path cwd;               // empty to run in the current directory
+    bool new_group = false; // own process group or job object, out of reach of Ctrl-C
+
+    Cmd();
+    Cmd(const std::string &cmd);
+    Cmd(const std::initializer_list<std::string> &cmd);
+
+    void append(const std::string &item);
+    void append_many(const strvec &items);
+    void append_many_prefixed(const std::string &prefix, const strvec &items);
+
+    std::string to_string() const;
+    void run() const;
+    Process run_async(Capture capture = Capture::None) const;
+    Process spawn(Capture capture = Capture::None) const; // run_async without logging
+    std::string run_capture() const;
+    void run_or_die(const std::string &message) const;
+    std::unique_ptr<char *[]> to_c_argv() const;
+#if __cpp_impl_coroutine
+    async::CmdAwaiter async(Capture capture = Capture::None) const; // see nbs::async
+#endif
+};
+
+NBSAPI void await_processes(const std::vector<Process> &processes);
+
+enum class JobserverMode
+{
+    None,
+    Fifo, // --jobserver-auth=fifo:PATH, GNU make 4.4 and later
+    Pipe, // --jobserver-auth=R,W with inherited descriptors
+};
+
+// GNU make jobserver protocol: every job but the first needs a token read
+// from a shared pipe, and writes it back when it is done. As a client we
+// take tokens from a parent make; as a server we hand out our own job limit
+// to make, cmake and nbs processes started by the build.
+struct Jobserver
+{
+    int read_fd = -1;
+    int write_fd = -1;
+    bool poll_before_read = false; // read_fd is shared and blocking
+    std::string tokens;            // held tokens, given back as they were read
+    std::string fifo_path;         // set when serving through a fifo
+    int pipe_fd = -1;              // read end handed to children when serving a pipe
+    bool makeflags_set = false;
+    bool had_makeflags = false;
+    std::string old_makeflags;
+
+    Jobserver() = default;
+    Jobserver(const Jobserver &) = delete;
+    Jobserver &operator=(const Jobserver &) = delete;
+    ~Jobserver();
+
+    bool connect(const std::string &makeflags);
+    bool serve(JobserverMode mode, size_t jobs);
+    bool active() const;
+    bool acquire();
+    void release();
+    bool wait(int timeout_ms) const;
+};
+
+#ifdef _WIN32
+std::string windows_error_code_to_str(DWORD error);
+std::string windows_last_error_str();
+#endif
+
+typedef std::vector<path> pathvec;
+
+NBSAPI strvec paths_to_strs(const pathvec &paths);
+NBSAPI pathvec strs_to_paths(const strvec &paths);
+NBSAPI int64_t compare_last_mod_time(const path &path1, const path &path2);
+NBSAPI bool make_directory_if_not_exists(const path &path);
+NBSAPI bool exists(const path &path);
+NBSAPI void rename(const os::path &from, const path &to);
+NBSAPI int64_t last_write_time(const os::path &path); // nanoseconds since the epoch, 0 if missing
+NBSAPI size_t cpu_count();
+NBSAPI uint64_t memory_limit();
+NBSAPI double system_load();
+NBSAPI bool read_file(const path &path, std::string &content);
+NBSAPI bool write_file(const path &path, const std::string &content);
+NBSAPI bool copy_file(const path &from, const path &to); // keeps the file mode
+NBSAPI bool hard_link(const path &from, const path &to);
+NBSAPI uint64_t link_count(const path &path); // 0 if missing
+NBSAPI bool remove(const path &path);
+NBSAPI void touch(const path &path);
+NBSAPI strvec list_directory(const path &path);
+NBSAPI std::string find_executable(const std::string &name);
+NBSAPI path absolute(const path &path);
+
+struct FileStat
+{
+    bool exists;
+    int64_t mtime; // nanoseconds since the epoch
+    uint64_t size;
+};
+
+NBSAPI FileStat stat_file(const path &path);
+
+// Remembers file stats for the duration of one build, so every path is
+// stat'ed at most once no matter how many targets depend on it.
+struct StatCache
+{
+    std::unordered_map<std::string, FileStat> entries;
+    size_t stat_calls = 0;
+
+    const FileStat &stat(const path &path);
+    bool exists(const path &path);
+    int64_t last_write_time(const path &path);
+    void invalidate(const path &path);
+};
+} // namespace os
+
+namespace str
+{
+NBSAPI std::string join(const std::string &sep, const strvec &strings);
+NBSAPI std::string trim_to(const std::string &str, const std::string &chars = "\n\r ");
+NBSAPI std::string trim_right_to(const std::string &str, const std::string &chars = "\n\r ");
+NBSAPI std::string trim_left_to(const std::string &str, const std::string &chars = "\n\r ");
+NBSAPI strvec split(const std::string &str, const std::string &delim);
+NBSAPI std::string change_extension(const std::string &file, const std::string &new_extension);
+NBSAPI std::string escape_json(const std::string &str);
+} // namespace str
+
+namespace log
+{
+enum LogLevel
+{
+    Info = 0,
+    Warning = 1,
+    Error = 2,
+};
+
+NBSAPI std::string log_level_str(LogLevel level);
+NBSAPI void log(LogLevel level, const std::string &message);
+NBSAPI void info(const std::string &message);
+NBSAPI void warning(const std::string &message);
+NBSAPI void error(const std::string &message);
+} // namespace log
+
+namespace hash
+{
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+
+NBSAPI uint64_t fnv1a(const void *data, size_t size, uint64_t seed = FNV_OFFSET_BASIS);
+NBSAPI uint64_t fnv1a(const std::string &str, uint64_t seed = FNV_OFFSET_BASIS);
+NBSAPI bool file(const os::path &path, uint64_t &hash);
+NBSAPI std::string to_hex(uint64_t hash);
+} // namespace hash
+
+namespace graph
+{
+template <typename T>
+using Edges = std::unordered_set<T>;
+
+template <typename T>
+using Graph = std::unordered_map<T, Edges<T>>;
+
+enum GraphError
+{
+    CycleDependency,
+    VertexNotFound
+};
+
+template <typename T>
+NBSAPI std::unordered_set<T> find_roots(const Graph<T> &graph);
+
+template <typename T>
+NBSAPI std::vector<std::vector<T>> topological_levels(
+    const Graph<T> &graph, const Edges<T> &roots);
+
+// Graph over dense integer ids interned from vertex names. After finish()
+// the edges of vertex i are edges[offsets[i]] .. edges[offsets[i + 1] - 1].
+template <typename T>
+struct DenseGraph
+{
+    std::vector<T> names;
+    std::unordered_map<T, size_t> ids;
+    std::vector<size_t> offsets;
+    std::vector<size_t> edges;
+    std::vector<std::pair<size_t, size_t>> unsorted_edges;
+
+    size_t intern(const T &name);
+    void add_edge(size_t from, size_t to);
+    void finish();
+    size_t size() const;
+};
+
+struct TopologicalOrder
+{
+    // Same as topological_levels: roots are at level 0, every other vertex
+    // one level below its deepest predecessor.
+    std::vector<std::vector<size_t>> levels;
+    // Vertices in the order they become ready when edges point to
+    // dependencies, i.e. every vertex comes after all of its edges.
+    std::vector<size_t> order;
+};
+
+template <typename T>
+NBSAPI TopologicalOrder topological_order(const DenseGraph<T> &graph, const std::vector<size_t> &roots);
+} // namespace graph
+
+namespace target
+{
+enum BuildError
+{
+    BUILD_CMD_ERROR,
+    BUILD_NO_RULE_FOR_TARGET_ERROR,
+    BUILD_CYCLE_DEPENDENCY_ERROR,
+    BUILD_UNKNOWN_POOL_ERROR,
+    BUILD_DUPLICATE_TARGET_ERROR,
+};
+
+struct Target
+{
+    os::path output;
+    std::vector<os::Cmd> cmds;
+    os::pathvec dependencies;
+    os::path depfile; // make-style depfile written by the commands, if any
+    os::path source;  // translation unit of a compile target, enables the compiler cache
+    bool cacheable = false; // restore the output from the action cache when commands and inputs match
+    std::string pool;       // limits concurrency together with TargetMap::pools, e.g. "link"
+
+    Target(const os::path &output, const os::Cmd &cmd, const os::pathvec &dependencies = {});
+    Target(const os::path &output, const std::vector<os::Cmd> &cmds, const os::pathvec &dependencies = {});
+
+    void build() const;
+    uint64_t cmd_hash() const;
+};
+
+NBSAPI strvec parse_depfile(const std::string &content);
+
+struct BuildLogInput
+{
+    std::string path;
+    int64_t mtime;
+    uint64_t hash; // 0 when the content was not hashed
+};
+
+// What nbs remembers about an output between invocations.
+struct BuildLogEntry
+{
+    uint64_t cmd_hash = 0;
+    int64_t mtime = 0;
+    uint64_t duration_us = 0;
+    uint64_t output_hash = 0; // content hash of the output, only with restat
+    uint64_t max_rss = 0;     // peak resident set size of the commands in bytes
+    std::vector<BuildLogInput> inputs;
+    strvec deps; // discovered dependencies, e.g. headers from a depfile
+};
+
+// Append-only binary log of finished targets. A later record for the same
+// output replaces an earlier one; the file is compacted on load once it
+// grows too much.
+struct BuildLog
+{
+    std::unordered_map<std::string, BuildLogEntry> entries;
+    size_t records = 0;
+
+    const BuildLogEntry *find(const std::string &output) const;
+    bool load(const os::path &path);
+    void save(const os::path &path) const;
+    void append(const os::path &path, const std::string &output, const BuildLogEntry &entry);
+};
+
+// One command as shown in the build trace; slot is the job slot it ran in.
+struct TraceEvent
+{
+    std::string name;
+    std::string cmd;
+    uint64_t start_us;
+    uint64_t duration_us;
+    size_t slot;
+    os::ProcessStatus status;
+};
+
+// Writes events in the Chrome trace event format, which can be opened in
+// Perfetto or chrome://tracing.
+NBSAPI void write_trace(const os::path &path, const std::vector<TraceEvent> &events);
+
+struct TargetTiming
+{
+    bool built = false;
+    uint64_t start_us = 0;
+    uint64_t end_us = 0;
+};
+
+// Prints the critical path, the achieved parallelism and the slowest
+// targets of a finished build. timings is indexed by node id of graph.
+NBSAPI void print_build_summary(const graph::DenseGraph<std::string> &graph, const std::vector<TargetTiming> &timings,
+                                uint64_t wall_us, size_t max_jobs);
+
+enum class SchedulePolicy
+{
+    InOrder,      // ready targets start in the order they became ready
+    CriticalPath, // the longest remaining chain of recorded durations first
+};
+
+struct TargetMap
+{
+    std::unordered_map<std::string, Target> targets;
+    size_t jobs = 0; // 0 means os::cpu_count()
+    os::path log_path = ".nbs_log"; // empty disables the build log
+    os::path trace_path;            // empty disables the build trace
+    bool summary = false;           // print a performance summary after each build
+    SchedulePolicy policy = SchedulePolicy::CriticalPath;
+    os::path cache_dir;                           // empty disables the compiler and action cache
+    uint64_t cache_max_size = 5ULL * 1024 * 1024 * 1024;
+    bool cache_hard_link = false;                 // link cached objects instead of copying
+    bool restat = false; // skip dependents of targets whose output content did not change
+    size_t compile_batch = 0; // compile up to this many ready objects per compiler call
+    os::JobserverMode jobserver = os::JobserverMode::None; // share the job limit with child builds
+    std::unordered_map<std::string, size_t> pools; // jobs allowed per Target::pool, 0 for no limit
+    uint64_t memory_budget = 0; // bytes for all running jobs, 0 uses the cgroup memory.max if any
+    double max_load = 0;        // start no jobs while os::system_load() is this high, like make -l
+    size_t keep_going = 1;      // stop after this many failed jobs, 0 never stops, like ninja -k
+    bool fail_fast = false;     // terminate the running jobs and their children when the build stops;
+                                // jobs then run in their own process groups and must not read the terminal
+    bool buffer_output = true;  // print each command's output in one piece once it is done
+    mutable BuildLog log;
+    mutable bool log_loaded = false;
+
+    TargetMap() = default;
+
+    void insert(Target &target);
+    bool remove(const std::string &target);
+    void build(const std::string &output) const;
+    void build_if_needs(const std::string &output) const;
+    bool needs_rebuild(const os::path &output) const;
+    void record_build(const Target &target, uint64_t duration_us, uint64_t max_rss = 0) const;
+    BuildLog &build_log() const;
+    strvec dependency_names(const Target &target) const;
+    void compute_dirty(const std::string &output, std::unordered_map<std::string, bool> &dirty,
+                       os::StatCache &stats) const;
+    bool is_dirty(const Target &target, const std::unordered_map<std::string, bool> &dirty,
+                  os::StatCache &stats) const;
+    uint64_t recorded_hash(const std::string &path, int64_t mtime) const;
+};
+} // namespace target
+
+namespace cache
+{
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// Content-addressed cache of target outputs. The directory may be shared
+// between checkouts and machines: entries are only ever written through a
+// temporary file and renamed into place.
+//
+// Compile targets work like ccache's direct mode. A manifest, keyed by the
+// compiler, its arguments and the source content, lists the headers of the
+// last compilation; the object itself is keyed by the manifest key and the
+// content of those headers.
+//
+// Other targets marked cacheable are keyed by their commands and the
+// content of their declared dependencies, which therefore must be complete.
+//
+// Limitation: -MMD depfiles leave out system headers, including those found
+// through -isystem, so they are not part of the key. Only the compiler
+// binary is, through compiler_id. Clear the cache after updating system
+// headers without updating the compiler.
+struct Cache
+{
+    os::path root;
+    uint64_t max_size = 5ULL * 1024 * 1024 * 1024;
+    bool hard_link = false;
+    CacheStats stats;
+    bool stored = false;
+    std::unordered_map<std::string, uint64_t> file_hashes;
+    std::unordered_map<std::string, std::string> compiler_ids;
+
+    Cache(const os::path &root);
+
+    os::path entry_path(const std::string &key, const std::string &extension) const;
+    bool file_hash(const std::string &path, uint64_t &hash);
+    std::string compiler_id(const std::string &compiler);
+    std::string manifest_key(const target::Target &target);
+    bool object_key(const std::string &manifest_key, const strvec &headers, std::string &key);
+    std::string action_key(const target::Target &target);
+    bool restore(const os::path &entry, const os::path &output, bool link);
+    bool fetch(const target::Target &target);
+    void store(const target::Target &target);
+    void invalidate(const std::string &path);
+    void finish();
+};
+
+NBSAPI bool is_compile(const target::Target &target);
+NBSAPI bool is_cacheable(const target::Target &target);
+} // namespace cache
+
+namespace c
+{
+enum class Compiler
+{
+    CC,
+    CXX,
+    GCC,
+    GXX,
+    CLANG,
+    CLANGXX,
+    MSVC,
+};
+
+enum CompileError
+{
+    COMPILE_UNSUPPORTED_ERROR,
+};
+
+struct CDefaults
+{
+    Compiler compiler = Compiler::CXX;
+    std::string standard;
+    strvec flags;
+    os::pathvec include_paths;
+    os::pathvec libs;
+    os::pathvec lib_paths;
+    strvec defines;
+    strvec other_flags;
+};
+
+NBSAPI CDefaults *get_cdefaults();
+// Compiles sources as a few combined translation units, each including a
+// batch of them, so common headers are parsed once per batch.
+struct UnityBuild
+{
+    std::string name = "unity"; // files are build_dir/<name>_N.cpp, unique per build_dir
+    size_t batch_size = 8;      // sources per unity file, 0 for no limit
+    uint64_t batch_bytes = 0;   // source bytes per unity file, 0 for no limit
+    os::pathvec exclude;        // sources that do not compile in unity mode
+};
+
+struct CompileOptions
+{
+    Compiler compiler = get_cdefaults()->compiler;
+    std::string standard = get_cdefaults()->standard;
+    strvec flags = get_cdefaults()->flags;
+    os::pathvec include_paths = get_cdefaults()->include_paths;
+    os::pathvec libs = get_cdefaults()->libs;
+    os::pathvec lib_paths = get_cdefaults()->lib_paths;
+    strvec defines = get_cdefaults()->defines;
+    strvec other_flags = get_cdefaults()->other_flags;
+    os::path pch = {};         // header to precompile and include in every object
+    os::path pch_output = {};  // defaults to pch_dir/<header path>.gch, or .pch for clang
+    os::path pch_dir = "build"; // keeps the default pch_output out of the source tree
+
+    os::Cmd cmd(const os::pathvec &sources, const strvec &additional_flags = {}) const;
+    os::Cmd exe_cmd(const os::path &output, const os::pathvec &sources) const;
+    os::Cmd obj_cmd(const os::path &output, const os::path &source) const;
+    target::Target obj_target(const os::path &output, const os::path &source) const;
+    os::path pch_path() const;
+    os::Cmd pch_cmd() const;
+    target::Target pch_target() const;
+    os::pathvec unity_targets(target::TargetMap &targets, const os::path &build_dir,
+                              const os::pathvec &sources, const UnityBuild &unity = {}) const;
+    os::Cmd static_lib_cmd(const os::path &output, const os::pathvec &sources) const;
+    os::Cmd dynamic_lib_cmd(const os::pathvec &sources) const; // TODO
+};
+
+NBSAPI std::string comp_str(Compiler comp);
+NBSAPI Compiler current_compiler();
+
+}; // namespace c
+
+namespace wget {
+enum class WgetBackend {
+    Wget,
+    Curl,
+    PowerShell,
+};
+
+void make_available(const os::path &path, const std::string &url, WgetBackend backend = WgetBackend::Curl);
+}; // namespace wget
+
+namespace vcpkg
+{
+struct TargetTriplet {
+    std::string triplet;
+    bool is_static;
+
+    std::string to_string() const;
+};
+
+struct Vcpkg {
+    TargetTriplet triplet;
+    nbs::os::path root;
+
+    Vcpkg();
+
+    Vcpkg &with_triplet(const std::string &triplet);
+    Vcpkg &with_root(const nbs::os::path &path);
+    nbs::os::pathvec include_paths() const;
+    nbs::os::pathvec library_paths() const;
+
+    void install() const;
+};
+}; // namespace vcpkg
+
+#if __cpp_impl_coroutine
+// C++20 coroutines over child processes: `co_await cmd.async()` suspends
+// until the command exits, so a build script can write
+//
+//     Task<void> build()
+//     {
+//         co_await generate.async();
+//         co_await when_all(std::move(compiles));
+//         co_await link.async();
+//     }
+//
+// and run(build()) overlaps every command that is waited on concurrently.
+// A single EventLoop resumes each coroutine when its process exits.
+namespace async
+{
+struct EventLoop
+{
+    os::ProcessGroup group;
+    std::vector<std::pair<os::Process, CmdAwaiter *>> waiting;
+    std::queue<std::coroutine_handle<>> ready;
+
+    void schedule(std::coroutine_handle<> handle);
+    bool run_one(); // false when nothing is ready or running
+};
+
+NBSAPI EventLoop &event_loop();
+
+// Resumes with the status of the command, throws PROCESS_EXIT_STATUS_ERROR
+// if it failed.
+struct CmdAwaiter
+{
+    os::Cmd cmd;
+    os::Capture capture = os::Capture::None;
+    std::coroutine_handle<> handle = nullptr;
+    std::optional<os::ProcessStatus> status = std::nullopt;
+
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> handle);
+    os::ProcessStatus await_resume();
+};
+
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> continuation = nullptr;
+    std::function<void()> on_done = nullptr; // see Task::start
+    std::exception_ptr error = nullptr;
+    bool started = false;
+    bool detached = false; // the Task is gone, free the frame at the end
+
+    struct FinalAwaiter
+    {
+        TaskPromiseBase *promise;
+
+        bool await_ready() const noexcept;
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle) noexcept;
+        void await_resume() const noexcept;
+    };
+
+    std::suspend_always initial_suspend() noexcept;
+    FinalAwaiter final_suspend() noexcept;
+    void unhandled_exception();
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+    std::optional<T> value = std::nullopt;
+
+    void return_value(T value)
+    {
+        this->value = std::move(value);
+    }
+
+    T result()
+    {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+    void return_void();
+    void result();
+};
+
+// Lazy: runs once awaited, started or passed to run(). Destroying a Task
+// that is still running lets it finish in the background.
+template <typename T = void>
+struct Task
+{
+    struct promise_type : TaskPromise<T>
+    {
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task &) = delete;
+
+    Task &operator =(Task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task()
+    {
+        release();
+    }
+
+    bool done() const
+    {
+        return handle.done();
+    }
+
+    // Schedules the task on the event loop if it has not started yet. on_done
+    // is called once it finishes, from the loop, and must not resume anything.
+    void start(std::function<void()> on_done = nullptr)
+    {
+        if (handle.done())
+        {
+            if (on_done) on_done();
+            return;
+        }
+        handle.promise().on_done = std::move(on_done);
+        if (handle.promise().started) return;
+        handle.promise().started = true;
+        event_loop().schedule(handle);
+    }
+
+    // Rethrows what the task threw; the task must be done.
+    T result()
+    {
+        return handle.promise().result();
+    }
+
+    struct Awaiter
+    {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() const noexcept
+        {
+            return handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+        {
+            handle.promise().continuation = continuation;
+            if (handle.promise().started) return std::noop_coroutine();
+            handle.promise().started = true;
+            return handle;
+        }
+
+        T await_resume()
+        {
+            return handle.promise().result();
+        }
+    };
+
+    Awaiter operator co_await() const noexcept
+    {
+        return Awaiter{handle};
+    }
+
+private:
+    void release()
+    {
+        if (!handle) return;
+        if (handle.promise().started && !handle.done())
+            handle.promise().detached = true;
+        else
+            handle.destroy();
+        handle = nullptr;
+    }
+};
+
+// Counts finished tasks for when_all and when_any.
+struct Join
+{
+    size_t remaining = 0;
+    size_t first = 0; // index of the first task to finish
+    bool arrived = false;
+    std::coroutine_handle<> continuation = nullptr;
+
+    struct Awaiter
+    {
+        Join *join;
+
+        bool await_ready() const noexcept;
+        void await_suspend(std::coroutine_handle<> handle) noexcept;
+        void await_resume() const noexcept;
+    };
+
+    void arrive(size_t index);
+    Awaiter operator co_await() noexcept;
+};
+
+// Runs the tasks concurrently and resumes once all of them finished, then
+// rethrows the first failure in task order.
+template <typename T>
+NBSAPI Task<std::vector<T>> when_all(std::vector<Task<T>> tasks)
+{
+    auto join = std::make_shared<Join>();
+    join->remaining = tasks.size();
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        tasks[i].start([join, i] { join->arrive(i); });
+    }
+    co_await *join;
+
+    std::vector<T> results;
+    for (auto &task : tasks)
+    {
+        results.emplace_back(task.result());
+    }
+    co_return results;
+}
+
+NBSAPI Task<void> when_all(std::vector<Task<void>> tasks);
+
+// Starts the tasks and resumes with the index of the first one to finish.
+// The others keep running; co_await tasks[i] for their results.
+template <typename T>
+NBSAPI Task<size_t> when_any(std::vector<Task<T>> &tasks)
+{
+    // TODO: Error
+    if (tasks.empty()) throw os::PROCESS_WAIT_ERROR;
+
+    auto join = std::make_shared<Join>();
+    join->remaining = 1;
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        tasks[i].start([join, i] { join->arrive(i); });
+    }
+    co_await *join;
+    co_return join->first;
+}
+
+// Drives the event loop until the task and everything it started finish,
+// then returns its result.
+template <typename T>
+NBSAPI T run(Task<T> task)
+{
+    EventLoop &loop = event_loop();
+    task.start();
+    while (!task.done())
+    {
+        // Nothing left to resume it, e.g. it awaits a Join nobody arrives at.
+        // TODO: Error
+        if (!loop.run_one()) throw os::PROCESS_WAIT_ERROR;
+    }
+    // Tasks it dropped while they were still running, e.g. when_any losers.
+    while (loop.run_one())
+    {
+    }
+    return task.result();
+}
+} // namespace async
+#endif
+}; // namespace nbs
+
+// -------------------------------
+//
+//        Implementation
+//
+// -------------------------------
+
+#ifdef NBS_IMPLEMENTATION
+
+namespace nbs
+{
+NBSAPI void self_update(int argc, char **argv, const std::string &source)
+{
+    assert(argc > 0);
+    std::string exe(argv[0]);
+
+    if (os::compare_last_mod_time(source, exe) < 0) return;
+
+    log::info("Updating");
+    log::info("Renaming " + exe + " to " + exe + ".old");
+    os::rename(exe, exe + ".old");
+
+    os::Cmd compile_cmd;
+    compile_cmd.append_many({c::comp_str(c::current_compiler()), source});
+#if defined(_MSC_VER) && !defined(__clang__)
+    compile_cmd.append_many({"-Fe:" + exe, "-FC", "-EHsc", "-nologo"});
+#if __cpp_impl_coroutine
+    compile_cmd.append("-std:c++20");
+#endif
+#else
+    compile_cmd.append_many({"-o", exe});
+    // nbs::async needs coroutines, which the default standard may not have.
+#if __cpp_impl_coroutine
+    compile_cmd.append("-std=c++20");
+#endif
+#endif
+    compile_cmd.run_or_die("Error during self_update!!!");
+
+    os::Cmd exe_cmd(exe);
+    for (int i = 1; i < argc; i++)
+    {
+        exe_cmd.append(argv[i]);
+    }
+    exe_cmd.run();
+
+    exit(0);
+}
+
+namespace os
+{
+Path::Path(const std::string &str) : buf(str) {}
+Path::Path(const char *str) : buf(str) {}
+
+// TODO: Windows...
+Path &Path::operator /=(const Path &other) {
+    if (this->buf.back() != '/') {
+        this->buf.push_back('/');
+    }
+
+    auto iter = other.buf.begin();
+    if (*iter == '/') {
+        iter++;
+    }
+
+    this->buf.append(iter, other.buf.end());
+
+    return *this;
+}
+
+Path Path::operator /(const Path &other) const {
+    return Path(*this) /= other;
+}
+
+Path &Path::operator /=(const std::string &other) {
+    return *this /= Path(other);
+}
+
+Path Path::operator /(const std::string &other) const {
+    return *this / Path(other);
+}
+
+Path &Path::operator /=(const char *other) {
+    return *this /= Path(other);
+}
+
+Path Path::operator /(const char *other) const {
+    return *this / Path(other);
+}
+
+#ifdef _WIN32
+Process::Process(HANDLE handle)
+    : handle(handle)
+{
+}
+#else
+Process::Process(int pid)
+    : pid(pid)
+{
+}
+#endif
+
+void Process::await() const
+{
+#ifdef _WIN32
+    DWORD result = WaitForSingleObject(handle, INFINITE);
+
+    if (result == WAIT_FAILED)
+    {
+        log::error(os::windows_last_error_str());
+        // TODO: Error
+        throw PROCESS_WAIT_ERROR;
+    }
+
+    DWORD exit_status;
+    // TODO: Error
+    if (!GetExitCodeProcess(handle, &exit_status)) throw PROCESS_GET_EXIT_CODE_ERROR;
+
+    // TODO: Error
+    if (exit_status != 0) throw PROCESS_EXIT_STATUS_ERROR;
+
+    CloseHandle(handle);
+    if (job != NULL) CloseHandle(job);
+#else
+    while (true)
+    {
+        int status = 0;
+        if (waitpid(pid, &status, 0) < 0)
+        {
+            // TODO: Error
+            throw PROCESS_WAIT_ERROR;
+        }
+
+        if (WIFEXITED(status))
+        {
+            int exit_status = WEXITSTATUS(status);
+            if (exit_status == 0) return;
+            // TODO: Error
+            else throw PROCESS_EXIT_STATUS_ERROR;
+        }
+
+        // TODO: Error
+        if (WIFSIGNALED(status)) throw PROCESS_WAIT_ERROR;
+    }
+#endif
+}
+
+void Process::terminate() const
+{
+#ifdef _WIN32
+    if (job != NULL)
+        TerminateJobObject(job, 1);
+    else
+        TerminateProcess(handle, 1);
+#else
+    kill(group ? -pid : pid, SIGTERM);
+#endif
+}
+
+bool Process::operator ==(const Process &other) const
+{
+#ifdef _WIN32
+    return handle == other.handle;
+#else
+    return pid == other.pid;
+#endif
+}
+
+bool ProcessStatus::success() const
+{
+    return !signaled && exit_code == 0;
+}
+
+ProcessGroup::~ProcessGroup()
+{
+#ifndef _WIN32
+    for (const auto &pidfd : pidfds)
+    {
+        close(pidfd.second);
+    }
+#endif
+}
+
+void ProcessGroup::add(const Process &process)
+{
+    processes.emplace_back(process);
+#ifdef SYS_pidfd_open
+    // Readable once the process exits, so wait_any can sleep in poll().
+    int pidfd = (int)syscall(SYS_pidfd_open, process.pid, 0);
+    if (pidfd >= 0) pidfds[process.pid] = pidfd;
+#endif
+}
+
+size_t ProcessGroup::size() const
+{
+    return processes.size();
+}
+
+bool ProcessGroup::empty() const
+{
+    return processes.empty();
+}
+
+#ifdef _WIN32
+// Appends what can be read without blocking; false at the end of the output.
+static bool read_output(HANDLE pipe, std::string &output)
+{
+    char buf[4096];
+    while (true)
+    {
+        // Fails once every writer is gone and the pipe is empty.
+        DWORD available = 0, n = 0;
+        if (!PeekNamedPipe(pipe, NULL, 0, NULL, &available, NULL)) return false;
+        if (available == 0) return true;
+        if (!ReadFile(pipe, buf, std::min<DWORD>(available, sizeof(buf)), &n, NULL) || n == 0) return false;
+        output.append(buf, n);
+    }
+}
+#else
+// Appends what can be read without blocking; false at the end of the output.
+static bool read_output(int fd, std::string &output)
+{
+    char buf[4096];
+    while (true)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0)
+        {
+            output.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return n < 0 && errno == EAGAIN;
+    }
+}
+#endif
+
+#ifdef _WIN32
+// Waits for one of the MAXIMUM_WAIT_OBJECTS processes from start on to
+// exit, the most WaitForMultipleObjects takes. Returns its index, or
+// processes.size() after the timeout.
+static size_t wait_for_exit(const std::vector<Process> &processes, size_t start, DWORD timeout_ms)
+{
+    DWORD count = (DWORD)std::min<size_t>(processes.size() - start, MAXIMUM_WAIT_OBJECTS);
+    std::vector<HANDLE> handles;
+    for (DWORD i = 0; i < count; i++)
+    {
+        handles.emplace_back(processes[start + i].handle);
+    }
+
+    DWORD result = WaitForMultipleObjects(count, handles.data(), FALSE, timeout_ms);
+    if (result == WAIT_TIMEOUT) return processes.size();
+    if (result == WAIT_FAILED || result >= WAIT_OBJECT_0 + count)
+    {
+        log::error(os::windows_last_error_str());
+        // TODO: Error
+        throw PROCESS_WAIT_ERROR;
+    }
+    return start + (result - WAIT_OBJECT_0);
+}
+
+// The index of a process that has exited, or processes.size().
+static size_t find_exited(const std::vector<Process> &processes)
+{
+    for (size_t start = 0; start < processes.size(); start += MAXIMUM_WAIT_OBJECTS)
+    {
+        size_t index = wait_for_exit(processes, start, 0);
+        if (index < processes.size()) return index;
+    }
+    return processes.size();
+}
+#endif
+
+bool ProcessGroup::any_exited() const
+{
+    if (processes.empty()) return false;
+#ifdef _WIN32
+    return find_exited(processes) < processes.size();
+#else
+    for (const auto &process : processes)
+    {
+        siginfo_t info{};
+        if (waitid(P_PID, process.pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0) return true;
+    }
+    return false;
+#endif
+}
+
+ProcessStatus ProcessGroup::wait_any()
+{
+    // TODO: Error
+    if (processes.empty()) throw PROCESS_WAIT_ERROR;
+
+#ifdef _WIN32
+    // A blocking wait only covers the first MAXIMUM_WAIT_OBJECTS processes,
+    // so with more the others are checked every 10ms. Anonymous pipes
+    // cannot be waited on, and a child blocked on a full pipe never exits,
+    // so captured output is drained as often.
+    size_t index = find_exited(processes);
+    while (index == processes.size())
+    {
+        bool capturing = false;
+        for (auto &process : processes)
+        {
+            if (process.output == NULL) continue;
+            if (read_output(process.output, outputs[process.handle]))
+            {
+                capturing = true;
+                continue;
+            }
+            CloseHandle(process.output);
+            process.output = NULL;
+        }
+
+        DWORD timeout = capturing || processes.size() > MAXIMUM_WAIT_OBJECTS ? 10 : INFINITE;
+        index = wait_for_exit(processes, 0, timeout);
+        if (index == processes.size()) index = find_exited(processes);
+    }
+
+    Process process = processes[index];
+    processes.erase(processes.begin() + index);
+
+    DWORD exit_code;
+    // TODO: Error
+    if (!GetExitCodeProcess(process.handle, &exit_code)) throw PROCESS_GET_EXIT_CODE_ERROR;
+
+    ProcessStatus result{process, (int)exit_code, false};
+    FILETIME creation, exit, kernel, user;
+    if (GetProcessTimes(process.handle, &creation, &exit, &kernel, &user))
+    {
+        uint64_t ticks = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+                         (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime);
+        result.cpu_time_us = ticks / 10;
+    }
+    // TODO: max_rss via GetProcessMemoryInfo
+
+    if (process.output != NULL)
+    {
+        read_output(process.output, outputs[process.handle]);
+        CloseHandle(process.output);
+    }
+    auto captured = outputs.find(process.handle);
+    if (captured != outputs.end())
+    {
+        result.output = std::move(captured->second);
+        outputs.erase(captured);
+    }
+
+    CloseHandle(process.handle);
+    if (process.job != NULL) CloseHandle(process.job);
+    return result;
+#else
+    while (true)
+    {
+        // Only our own children: wait4(-1) would also reap processes that
+        // the build script or another group waits for.
+        for (auto it = processes.begin(); it != processes.end(); it++)
+        {
+            int status = 0;
+            struct rusage usage{};
+            int pid = wait4(it->pid, &status, WNOHANG, &usage);
+            // TODO: Error
+            if (pid < 0 && errno != EINTR) throw PROCESS_WAIT_ERROR;
+            if (pid <= 0 || (!WIFEXITED(status) && !WIFSIGNALED(status))) continue;
+
+            ProcessStatus result = WIFEXITED(status) ? ProcessStatus{Process(pid), WEXITSTATUS(status), false}
+                                                     : ProcessStatus{Process(pid), WTERMSIG(status), true};
+            result.cpu_time_us = (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec +
+                                 (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+#ifdef __APPLE__
+            result.max_rss = (uint64_t)usage.ru_maxrss;
+#else
+            result.max_rss = (uint64_t)usage.ru_maxrss * 1024;
+#endif
+            int output = it->output;
+            processes.erase(it);
+
+            auto pidfd = pidfds.find(pid);
+            if (pidfd != pidfds.end())
+            {
+                close(pidfd->second);
+                pidfds.erase(pidfd);
+            }
+            if (output >= 0)
+            {
+                read_output(output, outputs[pid]);
+                close(output);
+            }
+            auto captured = outputs.find(pid);
+            if (captured != outputs.end())
+            {
+                result.output = std::move(captured->second);
+                outputs.erase(captured);
+            }
+            return result;
+        }
+
+        // Sleep until a child exits or writes output. Captured output has
+        // to be drained anyway: a child blocked on a full pipe never exits.
+        // Without a pidfd for every child the timeout bounds the latency.
+        std::vector<struct pollfd> fds;
+        for (const auto &process : processes)
+        {
+            if (process.output >= 0) fds.push_back(pollfd{process.output, POLLIN, 0});
+            auto pidfd = pidfds.find(process.pid);
+            if (pidfd != pidfds.end()) fds.push_back(pollfd{pidfd->second, POLLIN, 0});
+        }
+        ::poll(fds.data(), fds.size(), pidfds.size() == processes.size() ? -1 : 10);
+        for (auto &process : processes)
+        {
+            if (process.output >= 0 && !read_output(process.output, outputs[process.pid]))
+            {
+                close(process.output);
+                process.output = -1;
+            }
+        }
+    }
+#endif
+}
+
+#ifndef _WIN32
+// A private, non-blocking open file description for an inherited pipe, so
+// O_NONBLOCK does not leak into the other processes sharing it.
+static int jobserver_reopen(int fd)
+{
+#ifdef __linux__
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    return open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#else
+    (void)fd;
+    return -1;
+#endif
+}
+#endif
+
+Jobserver::~Jobserver()
+{
+#ifndef _WIN32
+    while (!tokens.empty()) release();
+    if (read_fd >= 0) close(read_fd);
+    if (write_fd >= 0 && write_fd != read_fd) close(write_fd);
+    if (pipe_fd >= 0) close(pipe_fd);
+    if (!fifo_path.empty()) unlink(fifo_path.c_str());
+    if (makeflags_set)
+    {
+        if (had_makeflags)
+            setenv("MAKEFLAGS", old_makeflags.c_str(), 1);
+        else
+            unsetenv("MAKEFLAGS");
+    }
+#endif
+}
+
+bool Jobserver::connect(const std::string &makeflags)
+{
+#ifdef _WIN32
+    // TODO: jobserver semaphores on Windows
+    (void)makeflags;
+    return false;
+#else
+    // The last option wins, older makes spell it --jobserver-fds.
+    std::string auth;
+    for (const char *option : {"--jobserver-fds=", "--jobserver-auth="})
+    {
+        size_t pos = makeflags.rfind(option);
+        if (pos == std::string::npos) continue;
+        pos += strlen(option);
+        auth = makeflags.substr(pos, makeflags.find(' ', pos) - pos);
+    }
+    if (auth.empty()) return false;
+
+    if (auth.compare(0, 5, "fifo:") == 0)
+    {
+        int fd = open(auth.c_str() + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+        {
+            log::warning("Could not open jobserver fifo " + auth.substr(5) + ": " + strerror(errno));
+            return false;
+        }
+        read_fd = write_fd = fd;
+        return true;
+    }
+
+    int r, w;
+    if (sscanf(auth.c_str(), "%d,%d", &r, &w) != 2) return false;
+    // make closes the descriptors for commands it does not consider
+    // recursive, i.e. without $(MAKE) or a leading +.
+    if (fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0)
+    {
+        log::warning("Jobserver is not available, mark the nbs rule with '+' in the Makefile");
+        return false;
+    }
+    read_fd = jobserver_reopen(r);
+    if (read_fd < 0)
+    {
+        read_fd = dup(r);
+        poll_before_read = true;
+    }
+    write_fd = dup(w);
+    fcntl(read_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(write_fd, F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+bool Jobserver::serve(JobserverMode mode, size_t jobs)
+{
+#ifdef _WIN32
+    // TODO: jobserver semaphores on Windows
+    (void)mode;
+    (void)jobs;
+    return false;
+#else
+    std::string auth;
+    if (mode == JobserverMode::Fifo)
+    {
+        static int counter = 0;
+        std::string path = "/tmp/nbs-jobserver-" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+        if (mkfifo(path.c_str(), 0600) != 0)
+        {
+            log::warning("Could not create jobserver fifo " + path + ": " + strerror(errno));
+            return false;
+        }
+        int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+        {
+            log::warning("Could not open jobserver fifo " + path + ": " + strerror(errno));
+            unlink(path.c_str());
+            return false;
+        }
+        fifo_path = path;
+        read_fd = write_fd = fd;
+        auth = "fifo:" + path;
+    }
+    else if (mode == JobserverMode::Pipe)
+    {
+        // The pipe itself is inherited by every child; we read through a
+        // private description and close both ends when the build is over.
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            log::warning(std::string("Could not create jobserver pipe: ") + strerror(errno));
+            return false;
+        }
+        pipe_fd = fds[0];
+        read_fd = jobserver_reopen(fds[0]);
+        if (read_fd < 0)
+        {
+            read_fd = dup(fds[0]);
+            poll_before_read = true;
+        }
+        fcntl(read_fd, F_SETFD, FD_CLOEXEC);
+        write_fd = fds[1];
+        auth = std::to_string(fds[0]) + "," + std::to_string(fds[1]);
+    }
+    else
+    {
+        return false;
+    }
+
+    // We keep the implicit token for ourselves.
+    for (size_t i = 1; i < jobs; i++)
+    {
+        ssize_t written = write(write_fd, "+", 1);
+        (void)written;
+    }
+
+    const char *makeflags = getenv("MAKEFLAGS");
+    had_makeflags = makeflags != NULL;
+    if (had_makeflags) old_makeflags = makeflags;
+    std::string flags = old_makeflags + " -j" + std::to_string(jobs) + " --jobserver-auth=" + auth;
+    setenv("MAKEFLAGS", flags.c_str(), 1);
+    makeflags_set = true;
+    return true;
+#endif
+}
+
+bool Jobserver::active() const
+{
+    return read_fd >= 0;
+}
+
+bool Jobserver::acquire()
+{
+#ifdef _WIN32
+    return false;
+#else
+    if (!active()) return false;
+    if (poll_before_read && !wait(0)) return false;
+
+    char token;
+    ssize_t n;
+    do
+    {
+        n = read(read_fd, &token, 1);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1) return false;
+    tokens.push_back(token);
+    return true;
+#endif
+}
+
+void Jobserver::release()
+{
+#ifndef _WIN32
+    if (tokens.empty()) return;
+    char token = tokens.back();
+    tokens.pop_back();
+    ssize_t n;
+    do
+    {
+        n = write(write_fd, &token, 1);
+    } while (n < 0 && errno == EINTR);
+#endif
+}
+
+bool Jobserver::wait(int timeout_ms) const
+{
+#ifdef _WIN32
+    (void)timeout_ms;
+    return false;
+#else
+    struct pollfd fd{read_fd, POLLIN, 0};
+    return ::poll(&fd, 1, timeout_ms) > 0;
+#endif
+}
+
+NBSAPI void await_processes(const std::vector<Process> &processes)
+{
+    ProcessGroup group;
+    for (const auto &proc : processes)
+    {
+        group.add(proc);
+    }
+
+    bool failed = false;
+    while (!group.empty())
+    {
+        if (!group.wait_any().success())
+            failed = true;
+    }
+
+    // TODO: Error
+    if (failed) throw PROCESS_EXIT_STATUS_ERROR;
+}
+
+static SpawnBackend spawn_backend = SpawnBackend::PosixSpawn;
+
+NBSAPI void set_spawn_backend(SpawnBackend backend)
+{
+    spawn_backend = backend;
+}
+
+Cmd::Cmd()
+{
+}
+
+Cmd::Cmd(const std::string &cmd)
+{
+    append(cmd);
+}
+
+Cmd::Cmd(const std::initializer_list<std::string> &cmd)
+{
+    append_many(cmd);
+}
+
+void Cmd::append(const std::string &item)
+{
+    items.emplace_back(item);
+}
+
+void Cmd::append_many(const strvec &items)
+{
+    for (auto item : items)
+    {
+        append(item);
+    }
+}
+
+void Cmd::append_many_prefixed(const std::string &prefix, const strvec &items)
+{
+    for (auto item : items)
+    {
+        append(prefix + item);
+    }
+}
+
+std::string Cmd::to_string() const
+{
+    // TODO: escape item
+    if (items.empty())
+        return "";
+
+    std::stringstream ss;
+    for (size_t i = 0; i < items.size() - 1; i++)
+    {
+        ss << items[i] << " ";
+    }
+    ss << items[items.size() - 1];
+
+    return ss.str();
+}
+
+void Cmd::run() const
+{
+    run_async().await();
+}
+
+Process Cmd::run_async(Capture capture) const
+{
+    log::info("CMD: " + to_string());
+    return spawn(capture);
+}
+
+#if __cpp_impl_coroutine
+async::CmdAwaiter Cmd::async(Capture capture) const
+{
+    return async::CmdAwaiter{*this, capture};
+}
+#endif
+
+// Runs the command and returns its stdout, e.g. to probe a compiler.
+std::string Cmd::run_capture() const
+{
+    Process process = run_async(Capture::Stdout);
+    std::string output;
+    char buf[4096];
+#ifdef _WIN32
+    DWORD n;
+    while (ReadFile(process.output, buf, sizeof(buf), &n, NULL) && n > 0)
+    {
+        output.append(buf, n);
+    }
+    CloseHandle(process.output);
+#else
+    while (true)
+    {
+        ssize_t n = read(process.output, buf, sizeof(buf));
+        if (n > 0)
+        {
+            output.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN)
+        {
+            struct pollfd fd{process.output, POLLIN, 0};
+            ::poll(&fd, 1, -1);
+            continue;
+        }
+        break;
+    }
+    close(process.output);
+#endif
+    process.await();
+    return output;
+}
+
+Process Cmd::spawn(Capture capture) const
+{
+    // TODO: Error
+    if (items.empty()) throw PROCESS_EMPTY_CMD_ERROR;
+
+    std::string args_str = to_string();
+
+#ifdef _WIN32
+    char *args = (char *)args_str.c_str(); // TODO: Proper Cmd.to_string
+    STARTUPINFO startupinfo;
+    ZeroMemory(&startupinfo, sizeof(startupinfo));
+    startupinfo.cb = sizeof(startupinfo);
+
+    startupinfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    // TODO: Error
+    if (startupinfo.hStdInput == INVALID_HANDLE_VALUE) throw PROCESS_GET_HANDLE_ERROR;
+
+    startupinfo.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    // TODO: Error
+    if (startupinfo.hStdOutput == INVALID_HANDLE_VALUE) throw PROCESS_GET_HANDLE_ERROR;
+
+    startupinfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    // TODO: Error
+    if (startupinfo.hStdError == INVALID_HANDLE_VALUE) throw PROCESS_GET_HANDLE_ERROR;
+
+    startupinfo.dwFlags |= STARTF_USESTDHANDLES;
+
+    HANDLE output_read = NULL, output_write = NULL;
+    if (capture != Capture::None)
+    {
+        SECURITY_ATTRIBUTES attributes{sizeof(attributes), NULL, TRUE};
+        // TODO: Error
+        if (!CreatePipe(&output_read, &output_write, &attributes, 0)) throw PROCESS_CREATE_ERROR;
+        SetHandleInformation(output_read, HANDLE_FLAG_INHERIT, 0);
+        startupinfo.hStdOutput = output_write;
+        if (capture == Capture::All) startupinfo.hStdError = output_write;
+    }
+
+    PROCESS_INFORMATION process_info;
+    ZeroMemory(&process_info, sizeof(process_info));
+
+    const char *dir = cwd.buf.empty() ? NULL : cwd.buf.c_str();
+    // Suspended until it is in the job, so its children are too.
+    DWORD flags = new_group ? CREATE_SUSPENDED : 0;
+    BOOL success = CreateProcessA(NULL, args, NULL, NULL, TRUE, flags, NULL, dir, &startupinfo, &process_info);
+    if (output_write != NULL) CloseHandle(output_write);
+    if (!success)
+    {
+        if (output_read != NULL) CloseHandle(output_read);
+        // TODO: Error
+        throw PROCESS_CREATE_ERROR;
+    }
+
+    Process process(process_info.hProcess);
+    process.output = output_read;
+    if (new_group)
+    {
+        process.job = CreateJobObject(NULL, NULL);
+        if (process.job != NULL && !AssignProcessToJobObject(process.job, process_info.hProcess))
+        {
+            CloseHandle(process.job);
+            process.job = NULL;
+        }
+        ResumeThread(process_info.hThread);
+    }
+    CloseHandle(process_info.hThread);
+    return process;
+#else
+    auto args = to_c_argv();
+    int pid;
+
+    // Both ends are close-on-exec, the child only keeps its dup2'ed copies.
+    int output_pipe[2] = {-1, -1};
+    if (capture != Capture::None)
+    {
+        if (pipe(output_pipe) < 0) throw PROCESS_CREATE_ERROR;
+        fcntl(output_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(output_pipe[1], F_SETFD, FD_CLOEXEC);
+        fcntl(output_pipe[0], F_SETFL, O_NONBLOCK);
+    }
+    auto close_output = [&](bool all) {
+        if (output_pipe[1] >= 0) close(output_pipe[1]);
+        if (all && output_pipe[0] >= 0) close(output_pipe[0]);
+    };
+    auto spawned = [&](int child) {
+        close_output(false);
+        Process process(child);
+        process.output = output_pipe[0];
+        process.group = new_group;
+        return process;
+    };
+
+    // Without posix_spawn_file_actions_addchdir_np a working directory needs fork.
+#ifdef NBS_SPAWN_CHDIR
+    bool can_spawn = true;
+#else
+    bool can_spawn = cwd.buf.empty();
+#endif
+    if (spawn_backend == SpawnBackend::PosixSpawn && can_spawn)
+    {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+#ifdef NBS_SPAWN_CHDIR
+        if (!cwd.buf.empty()) posix_spawn_file_actions_addchdir_np(&actions, cwd.buf.c_str());
+#endif
+        if (capture != Capture::None)
+        {
+            posix_spawn_file_actions_adddup2(&actions, output_pipe[1], STDOUT_FILENO);
+            if (capture == Capture::All) posix_spawn_file_actions_adddup2(&actions, output_pipe[1], STDERR_FILENO);
+        }
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        if (new_group)
+        {
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+            posix_spawnattr_setpgroup(&attr, 0);
+        }
+        int err = posix_spawnp(&pid, args[0], &actions, &attr, args.get(), environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        if (err != 0)
+        {
+            close_output(true);
+            log::error("Could not run " + items[0] + ": " + strerror(err));
+            // TODO: Error
+            throw PROCESS_EXEC_ERROR;
+        }
+        return spawned(pid);
+    }
+
+    // The child reports a failed exec through a close-on-exec pipe, so the
+    // parent sees the error and the child never returns into the caller.
+    int error_pipe[2];
+    if (pipe(error_pipe) < 0)
+    {
+        close_output(true);
+        throw PROCESS_CREATE_ERROR;
+    }
+    fcntl(error_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    pid = fork();
+    if (pid < 0)
+    {
+        close(error_pipe[0]);
+        close(error_pipe[1]);
+        close_output(true);
+        throw PROCESS_CREATE_ERROR;
+    }
+    else if (pid == 0)
+    {
+        close(error_pipe[0]);
+        if (new_group) setpgid(0, 0);
+        if (capture != Capture::None)
+        {
+            dup2(output_pipe[1], STDOUT_FILENO);
+            if (capture == Capture::All) dup2(output_pipe[1], STDERR_FILENO);
+        }
+        if (cwd.buf.empty() || chdir(cwd.buf.c_str()) == 0) execvp(args[0], args.get());
+        int err = errno;
+        ssize_t written = write(error_pipe[1], &err, sizeof(err));
+        (void)written;
+        _exit(127);
+    }
+
+    // Also from here, so the group exists before we could signal it.
+    if (new_group) setpgid(pid, pid);
+    close(error_pipe[1]);
+    int err = 0;
+    ssize_t n;
+    do
+    {
+        n = read(error_pipe[0], &err, sizeof(err));
+    } while (n < 0 && errno == EINTR);
+    close(error_pipe[0]);
+
+    if (n == sizeof(err))
+    {
+        waitpid(pid, NULL, 0);
+        close_output(true);
+        log::error("Could not run " + items[0] + ": " + strerror(err));
+        // TODO: Error
+        throw PROCESS_EXEC_ERROR;
+    }
+    return spawned(pid);
+#endif
+}
+
+void Cmd::run_or_die(const std::string &message) const
+{
+    try {
+        run();
+    // TODO: Error
+    } catch (int) {
+        nbs::log::error(message);
+        exit(1);
+    }
+}
+
+std::unique_ptr<char *[]> Cmd::to_c_argv() const
+{
+    auto result = std::make_unique<char *[]>(items.size() + 1);
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        result[i] = (char *)items[i].c_str();
+    }
+    result[items.size()] = NULL;
+    return result;
+}
+
+#ifdef _WIN32
+std::string windows_error_code_to_str(DWORD error)
+{
+    // https://stackoverflow.com/questions/1387064/how-to-get-the-error-message-from-the-error-code-returned-by-getlasterror
+
+    LPSTR messageBuffer = nullptr;
+
+    DWORD size = FormatMessage(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, nullptr, error,
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), reinterpret_cast<LPSTR>(&messageBuffer), 0, nullptr);
+
+    return messageBuffer;
+}
+
+std::string windows_last_error_str()
+{
+    DWORD error = GetLastError();
+    return windows_error_code_to_str(error);
+}
+#endif
+
+NBSAPI strvec paths_to_strs(const pathvec &paths)
+{
+    strvec result;
+    for (const path &path : paths)
+    {
+        result.push_back(path.buf);
+    }
+    return result;
+}
+
+NBSAPI pathvec strs_to_paths(const strvec &paths)
+{
+    size_t size = paths.size();
+    pathvec result(size);
+    std::copy_n(paths.begin(), size, result.begin());
+    return result;
+}
+
+NBSAPI int64_t compare_last_mod_time(const path &path1, const path &path2)
+{
+    return os::last_write_time(path1) - os::last_write_time(path2);
+}
+
+NBSAPI bool make_directory_if_not_exists(const path &path)
+{
+#if _WIN32
+    // TODO: Error handling
+    CreateDirectory(path.buf.c_str(), NULL);
+    return true;
+#else
+    if (exists(path)) {
+        return true;
+    }
+
+    return mkdir(path.buf.c_str(), 0777) == 0;
+#endif
+}
+
+NBSAPI bool exists(const path &path)
+{
+    struct stat st{};
+    return stat(path.buf.c_str(), &st) == 0;
+}
+
+NBSAPI void rename(const os::path &from, const path &to) {
+#if _WIN32
+    bool ok = MoveFileEx(from.buf.c_str(), to.buf.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    bool ok = std::rename(from.buf.c_str(), to.buf.c_str()) == 0;
+#endif
+    // TODO: Error
+    if (!ok) throw FILE_RENAME_ERROR;
+}
+
+NBSAPI int64_t last_write_time(const os::path &path)
+{
+    return stat_file(path).mtime;
+}
+
+NBSAPI FileStat stat_file(const path &path)
+{
+#if _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(path.buf.c_str(), GetFileExInfoStandard, &data)) return FileStat{false, 0, 0};
+
+    // FILETIME counts 100ns ticks since 1601-01-01.
+    const int64_t TICKS_TO_UNIX_EPOCH = 116444736000000000LL;
+    int64_t val = ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    uint64_t size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    return FileStat{true, (val - TICKS_TO_UNIX_EPOCH) * 100, size};
+#else
+#if defined(__linux__) && defined(STATX_MTIME)
+    // statx lets us ask for just the two fields we need, which saves work
+    // on network filesystems. Fall back to stat on kernels without it.
+    static bool have_statx = true;
+    if (have_statx)
+    {
+        struct statx stx{};
+        if (statx(AT_FDCWD, path.buf.c_str(), 0, STATX_MTIME | STATX_SIZE, &stx) == 0)
+        {
+            int64_t mtime = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+            return FileStat{true, mtime, (uint64_t)stx.stx_size};
+        }
+        if (errno != ENOSYS) return FileStat{false, 0, 0};
+        have_statx = false;
+    }
+#endif
+    struct stat st{};
+    if (stat(path.buf.c_str(), &st) != 0) return FileStat{false, 0, 0};
+#ifdef __APPLE__
+    const struct timespec &ts = st.st_mtimespec;
+#else
+    const struct timespec &ts = st.st_mtim;
+#endif
+    return FileStat{true, (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, (uint64_t)st.st_size};
+#endif
+}
+
+const FileStat &StatCache::stat(const path &path)
+{
+    auto it = entries.find(path.buf);
+    if (it != entries.end()) return it->second;
+
+    stat_calls++;
+    return entries.insert({path.buf, stat_file(path)}).first->second;
+}
+
+bool StatCache::exists(const path &path)
+{
+    return stat(path).exists;
+}
+
+int64_t StatCache::last_write_time(const path &path)
+{
+    return stat(path).mtime;
+}
+
+void StatCache::invalidate(const path &path)
+{
+    entries.erase(path.buf);
+}
+
+NBSAPI bool read_file(const path &path, std::string &content)
+{
+    std::ifstream file(path.buf, std::ios::binary);
+    if (!file) return false;
+    std::stringstream ss;
+    ss << file.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+// Writes through a temporary file, so readers never see a partial file.
+// mode < 0 leaves the default permissions.
+static bool write_file_with_mode(const path &path, const std::string &content, int mode)
+{
+    // Unique across processes and, for shared directories, across machines.
+#if _WIN32
+    std::string pid = std::to_string(GetCurrentProcessId());
+#else
+    std::string pid = std::to_string(getpid());
+#endif
+    auto now = std::chrono::system_clock::now().time_since_epoch().count();
+    os::path tmp = path.buf + ".tmp" + pid + "." + std::to_string(now);
+    bool ok;
+    {
+        std::ofstream file(tmp.buf, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+        file.write(content.data(), content.size());
+        file.close();
+        ok = !file.fail();
+    }
+#if _WIN32
+    (void)mode;
+#else
+    if (ok && mode >= 0) ok = chmod(tmp.buf.c_str(), (mode_t)mode) == 0;
+#endif
+    if (ok)
+    {
+        try {
+            os::rename(tmp, path);
+            return true;
+        } catch (FileError e) {
+        }
+    }
+    os::remove(tmp);
+    return false;
+}
+
+NBSAPI bool write_file(const path &path, const std::string &content)
+{
+    return write_file_with_mode(path, content, -1);
+}
+
+NBSAPI bool copy_file(const path &from, const path &to)
+{
+    std::string content;
+    if (!read_file(from, content)) return false;
+#if _WIN32
+    int mode = -1;
+#else
+    // E.g. a cached executable has to come back executable.
+    struct stat st{};
+    int mode = stat(from.buf.c_str(), &st) == 0 ? (int)(st.st_mode & 07777) : -1;
+#endif
+    return write_file_with_mode(to, content, mode);
+}
+
+NBSAPI bool hard_link(const path &from, const path &to)
+{
+    os::remove(to);
+#if _WIN32
+    return CreateHardLink(to.buf.c_str(), from.buf.c_str(), NULL);
+#else
+    return link(from.buf.c_str(), to.buf.c_str()) == 0;
+#endif
+}
+
+NBSAPI uint64_t link_count(const path &path)
+{
+#if _WIN32
+    HANDLE hfile = CreateFile(path.buf.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) return 0;
+    BY_HANDLE_FILE_INFORMATION info;
+    uint64_t count = GetFileInformationByHandle(hfile, &info) ? info.nNumberOfLinks : 0;
+    CloseHandle(hfile);
+    return count;
+#else
+    struct stat st{};
+    return stat(path.buf.c_str(), &st) == 0 ? st.st_nlink : 0;
+#endif
+}
+
+NBSAPI bool remove(const path &path)
+{
+    return std::remove(path.buf.c_str()) == 0;
+}
+
+NBSAPI void touch(const path &path)
+{
+#if _WIN32
+    HANDLE hfile = CreateFile(path.buf.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) return;
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(hfile, NULL, NULL, &now);
+    CloseHandle(hfile);
+#else
+    utimes(path.buf.c_str(), NULL);
+#endif
+}
+
+NBSAPI strvec list_directory(const path &path)
+{
+    strvec result;
+#if _WIN32
+    WIN32_FIND_DATA data;
+    HANDLE find = FindFirstFile((path / "*").buf.c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) return result;
+    do
+    {
+        std::string name = data.cFileName;
+        if (name != "." && name != "..") result.emplace_back(name);
+    } while (FindNextFile(find, &data));
+    FindClose(find);
+#else
+    DIR *dir = opendir(path.buf.c_str());
+    if (dir == NULL) return result;
+    while (struct dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..") result.emplace_back(name);
+    }
+    closedir(dir);
+#endif
+    return result;
+}
+
+NBSAPI std::string find_executable(const std::string &name)
+{
+#if _WIN32
+    const char *separator = ";";
+    strvec suffixes = {"", ".exe"};
+#else
+    const char *separator = ":";
+    strvec suffixes = {""};
+#endif
+    if (name.find('/') != std::string::npos || name.find('\\') != std::string::npos) return name;
+
+    const char *env = getenv("PATH");
+    if (env == NULL) return "";
+    for (const auto &dir : str::split(env, separator))
+    {
+        for (const auto &suffix : suffixes)
+        {
+            os::path candidate = os::path(dir.empty() ? "." : dir) / (name + suffix);
+            if (exists(candidate)) return candidate.buf;
+        }
+    }
+    return "";
+}
+
+NBSAPI path absolute(const path &path)
+{
+#if _WIN32
+    char buf[MAX_PATH];
+    DWORD size = GetFullPathName(path.buf.c_str(), MAX_PATH, buf, NULL);
+    if (size == 0 || size >= MAX_PATH) return path;
+    return os::path(std::string(buf, size));
+#else
+    if (!path.buf.empty() && path.buf[0] == '/') return path;
+    char buf[4096];
+    if (getcwd(buf, sizeof(buf)) == NULL) return path;
+    return os::path(buf) / path;
+#endif
+}
+
+#ifdef __linux__
+// The cgroup v2 directory of this process, empty without cgroup v2.
+static std::string cgroup_dir()
+{
+    std::string content;
+    if (!read_file("/proc/self/cgroup", content)) return "";
+    for (const auto &line : str::split(content, "\n"))
+    {
+        if (line.compare(0, 3, "0::") != 0) continue;
+        std::string path = line.substr(3);
+        return "/sys/fs/cgroup" + (path == "/" ? "" : path);
+    }
+    return "";
+}
+
+// Calls f with the contents of a cgroup interface file of our cgroup and of
+// each of its parents, innermost first.
+static void cgroup_read_up(const std::string &name, const std::function<void(const std::string &)> &f)
+{
+    std::string dir = cgroup_dir();
+    const std::string root = "/sys/fs/cgroup";
+    while (dir.size() >= root.size())
+    {
+        std::string content;
+        if (read_file(dir + "/" + name, content)) f(content);
+        if (dir.size() == root.size()) break;
+        dir.resize(dir.find_last_of('/'));
+    }
+}
+#endif
+
+// The CPUs this process can actually use: the affinity mask, e.g. from
+// taskset, capped by a cgroup CPU quota, e.g. docker --cpus.
+NBSAPI size_t cpu_count()
+{
+    size_t count = std::thread::hardware_concurrency();
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) count = CPU_COUNT(&set);
+
+    cgroup_read_up("cpu.max", [&](const std::string &content) {
+        if (content.compare(0, 3, "max") == 0) return;
+        unsigned long long quota = 0, period = 0;
+        if (sscanf(content.c_str(), "%llu %llu", &quota, &period) != 2 || period == 0) return;
+        size_t cpus = (size_t)((quota + period - 1) / period);
+        count = std::min(count, std::max<size_t>(cpus, 1));
+    });
+#endif
+    return count > 0 ? count : 1;
+}
+
+// The tightest cgroup memory.max of this process and its parents in
+// bytes, 0 when there is none.
+NBSAPI uint64_t memory_limit()
+{
+    uint64_t limit = 0;
+#ifdef __linux__
+    cgroup_read_up("memory.max", [&](const std::string &content) {
+        if (content.compare(0, 3, "max") == 0) return;
+        uint64_t value = strtoull(content.c_str(), NULL, 10);
+        if (value > 0 && (limit == 0 || value < limit)) limit = value;
+    });
+#endif
+    return limit;
+}
+
+// How many processes want a CPU: on Linux the number runnable right now,
+// which unlike the load average does not lag behind jobs we just started;
+// elsewhere the one minute load average. Negative when unknown.
+NBSAPI double system_load()
+{
+#ifdef __linux__
+    std::string content;
+    if (read_file("/proc/loadavg", content))
+    {
+        // "0.50 0.40 0.30 3/512 1234", we are one of the runnable ones.
+        double avg1, avg5, avg15;
+        int runnable, total;
+        if (sscanf(content.c_str(), "%lf %lf %lf %d/%d", &avg1, &avg5, &avg15, &runnable, &total) == 5)
+            return runnable > 0 ? runnable - 1 : 0;
+    }
+#endif
+#ifndef _WIN32
+    double load;
+    if (getloadavg(&load, 1) == 1) return load;
+#endif
+    return -1;
+}
+} // namespace os
+
+namespace str
+{
+NBSAPI std::string join(const std::string &sep, const strvec &strings)
+{
+    if (strings.empty())
+        return "";
+
+    if (strings.size() == 1)
+        return strings[0];
+
+    std::stringstream ss;
+    for (size_t i = 0; i < strings.size() - 1; i++)
+    {
+        ss << strings[i];
+        ss << sep;
+    }
+    ss << strings.back();
+
+    return ss.str();
+}
+
+NBSAPI std::string trim_to(const std::string &str, const std::string &chars)
+{
+    return trim_right_to(trim_left_to(str), chars);
+}
+
+NBSAPI std::string trim_right_to(const std::string &str, const std::string &chars)
+{
+    size_t count = str.size();
+    while (count > 0 && chars.find(str[count - 1]) == std::string::npos)
+    {
+        count--;
+    }
+    return str.substr(0, count);
+}
+
+NBSAPI std::string trim_left_to(const std::string &str, const std::string &chars)
+{
+    size_t index = 0;
+    while (index < str.size() && chars.find(str[index]) == std::string::npos)
+    {
+        index++;
+    }
+    return str.substr(index);
+}
+
+NBSAPI strvec split(const std::string &str, const std::string &delim)
+{
+    if (str.empty())
+        return {""};
+
+    strvec result;
+    size_t index = 0;
+    size_t count = 0;
+
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        char c = str[i];
+        if (delim.find(c) == std::string::npos)
+        {
+            count++;
+        }
+        else
+        {
+            result.emplace_back(str.substr(index, count));
+            index = i + 1;
+            count = 0;
+        }
+    }
+    result.emplace_back(str.substr(index, count));
+
+    return result;
+}
+
+NBSAPI std::string change_extension(const std::string &file, const std::string &new_extension)
+{
+    return trim_right_to(file, ".") + new_extension;
+}
+
+NBSAPI std::string escape_json(const std::string &str)
+{
+    std::string result;
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"':
+            result += "\\\"";
+            break;
+        case '\\':
+            result += "\\\\";
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        case '\r':
+            result += "\\r";
+            break;
+        case '\t':
+            result += "\\t";
+            break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                result += buf;
+            }
+            else
+            {
+                result.push_back(c);
+            }
+        }
+    }
+    return result;
+}
+} // namespace str
+
+namespace log
+{
+static LogLevel minimal_level = Info;
+
+NBSAPI std::string log_level_str(LogLevel level)
+{
+    switch (level)
+    {
+    case Info:
+        return "INFO";
+    case Warning:
+        return "WARNING";
+    case Error:
+        return "ERROR";
+    default:
+        return "UNKNOWN LOG LEVEL";
+    }
+}
+
+NBSAPI void log(LogLevel level, const std::string &message)
+{
+    if (level < minimal_level)
+        return;
+
+    (level == Info ? std::cout : std::cerr) << '[' << log_level_str(level) << "] " << message << '\n';
+}
+
+NBSAPI void info(const std::string &message)
+{
+    log(Info, message);
+}
+
+NBSAPI void warning(const std::string &message)
+{
+    log(Warning, message);
+}
+
+NBSAPI void error(const std::string &message)
+{
+    log(Error, message);
+}
+
+} // namespace log
+
+namespace hash
+{
+NBSAPI uint64_t fnv1a(const void *data, size_t size, uint64_t seed)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+NBSAPI uint64_t fnv1a(const std::string &str, uint64_t seed)
+{
+    return fnv1a(str.data(), str.size(), seed);
+}
+
+NBSAPI bool file(const os::path &path, uint64_t &hash)
+{
+    std::ifstream file(path.buf, std::ios::binary);
+    if (!file) return false;
+
+    hash = FNV_OFFSET_BASIS;
+    char buf[64 * 1024];
+    while (file.read(buf, sizeof(buf)) || file.gcount() > 0)
+    {
+        hash = fnv1a(buf, file.gcount(), hash);
+    }
+    return true;
+}
+
+NBSAPI std::string to_hex(uint64_t hash)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)hash);
+    return buf;
+}
+} // namespace hash
+
+namespace graph
+{
+template <typename T>
+NBSAPI std::unordered_set<T> find_roots(const Graph<T> &graph)
+{
+    std::unordered_set<T> result;
+
+    for (const auto &pair : graph)
+    {
+        result.insert(pair.first);
+    }
+
+    for (const auto &pair : graph)
+    {
+        for (const auto &vertex : pair.second)
+        {
+            result.erase(vertex);
+        }
+    }
+
+    return result;
+}
+
+template <typename T>
+NBSAPI std::vector<std::vector<T>> topological_levels(
+    const Graph<T> &graph, const Edges<T> &roots
+) {
+    DenseGraph<T> dense;
+    for (const auto &pair : graph)
+    {
+        dense.intern(pair.first);
+    }
+    for (const auto &pair : graph)
+    {
+        size_t from = dense.ids[pair.first];
+        for (const T &edge : pair.second)
+        {
+            auto it = dense.ids.find(edge);
+            if (it == dense.ids.end()) throw VertexNotFound;
+            dense.add_edge(from, it->second);
+        }
+    }
+    dense.finish();
+
+    std::vector<size_t> root_ids;
+    for (const T &root : roots)
+    {
+        auto it = dense.ids.find(root);
+        if (it == dense.ids.end()) throw VertexNotFound;
+        root_ids.emplace_back(it->second);
+    }
+
+    TopologicalOrder order = topological_order(dense, root_ids);
+
+    std::vector<std::vector<T>> result(order.levels.size());
+    for (size_t level = 0; level < order.levels.size(); level++)
+    {
+        for (size_t id : order.levels[level])
+        {
+            result[level].emplace_back(dense.names[id]);
+        }
+    }
+
+    return result;
+}
+
+template <typename T>
+size_t DenseGraph<T>::intern(const T &name)
+{
+    auto it = ids.find(name);
+    if (it != ids.end()) return it->second;
+
+    names.emplace_back(name);
+    ids.insert({name, names.size() - 1});
+    return names.size() - 1;
+}
+
+template <typename T>
+void DenseGraph<T>::add_edge(size_t from, size_t to)
+{
+    unsorted_edges.emplace_back(from, to);
+}
+
+template <typename T>
+void DenseGraph<T>::finish()
+{
+    for (size_t i = 0; i + 1 < offsets.size(); i++)
+    {
+        for (size_t e = offsets[i]; e < offsets[i + 1]; e++)
+        {
+            unsorted_edges.emplace_back(i, edges[e]);
+        }
+    }
+
+    offsets.assign(names.size() + 1, 0);
+    for (const auto &edge : unsorted_edges)
+    {
+        offsets[edge.first + 1]++;
+    }
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        offsets[i + 1] += offsets[i];
+    }
+
+    edges.assign(unsorted_edges.size(), 0);
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (const auto &edge : unsorted_edges)
+    {
+        edges[next[edge.first]++] = edge.second;
+    }
+
+    unsorted_edges.clear();
+    unsorted_edges.shrink_to_fit();
+}
+
+template <typename T>
+size_t DenseGraph<T>::size() const
+{
+    return names.size();
+}
+
+// Kahn's algorithm restricted to the vertices reachable from roots. Runs in
+// O(V + E) without recursion.
+template <typename T>
+NBSAPI TopologicalOrder topological_order(const DenseGraph<T> &graph, const std::vector<size_t> &roots)
+{
+    size_t size = graph.size();
+    std::vector<char> reachable(size, 0);
+    std::vector<size_t> reached;
+    std::vector<size_t> indegree(size, 0);
+    std::vector<size_t> outdegree(size, 0);
+
+    std::vector<size_t> stack;
+    for (size_t root : roots)
+    {
+        if (reachable[root]) continue;
+        reachable[root] = 1;
+        stack.emplace_back(root);
+    }
+    while (!stack.empty())
+    {
+        size_t v = stack.back();
+        stack.pop_back();
+        reached.emplace_back(v);
+        for (size_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++)
+        {
+            size_t u = graph.edges[e];
+            indegree[u]++;
+            outdegree[v]++;
+            if (reachable[u]) continue;
+            reachable[u] = 1;
+            stack.emplace_back(u);
+        }
+    }
+
+    TopologicalOrder result;
+
+    // Levels: walk from the roots towards the leaves.
+    std::vector<size_t> level(size, 0);
+    std::vector<size_t> queue;
+    size_t max_level = 0;
+    for (size_t v : reached)
+    {
+        if (indegree[v] == 0) queue.emplace_back(v);
+    }
+    for (size_t head = 0; head < queue.size(); head++)
+    {
+        size_t v = queue[head];
+        max_level = std::max(max_level, level[v]);
+        for (size_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++)
+        {
+            size_t u = graph.edges[e];
+            level[u] = std::max(level[u], level[v] + 1);
+            if (--indegree[u] == 0) queue.emplace_back(u);
+        }
+    }
+    if (queue.size() != reached.size()) throw CycleDependency;
+
+    if (!reached.empty()) result.levels.resize(max_level + 1);
+    for (size_t v : queue)
+    {
+        result.levels[level[v]].emplace_back(v);
+    }
+
+    // Ready order: walk from the leaves towards the roots over the reversed
+    // edges of the reachable part.
+    std::vector<size_t> reverse_offsets(size + 1, 0);
+    for (size_t v : reached)
+    {
+        for (size_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++)
+        {
+            reverse_offsets[graph.edges[e] + 1]++;
+        }
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        reverse_offsets[i + 1] += reverse_offsets[i];
+    }
+    std::vector<size_t> reverse_edges(reverse_offsets[size]);
+    std::vector<size_t> next(reverse_offsets.begin(), reverse_offsets.end() - 1);
+    for (size_t v : reached)
+    {
+        for (size_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++)
+        {
+            reverse_edges[next[graph.edges[e]]++] = v;
+        }
+    }
+
+    for (size_t v : reached)
+    {
+        if (outdegree[v] == 0) result.order.emplace_back(v);
+    }
+    for (size_t head = 0; head < result.order.size(); head++)
+    {
+        size_t v = result.order[head];
+        for (size_t e = reverse_offsets[v]; e < reverse_offsets[v + 1]; e++)
+        {
+            size_t u = reverse_edges[e];
+            if (--outdegree[u] == 0) result.order.emplace_back(u);
+        }
+    }
+
+    return result;
+}
+} // namespace graph
+
+namespace target
+{
+Target::Target(const os::path &output, const os::Cmd &cmd, const os::pathvec &dependencies)
+    : output(output), cmds({cmd}), dependencies(dependencies)
+{
+}
+Target::Target(const os::path &output, const std::vector<os::Cmd> &cmds, const os::pathvec &dependencies)
+    : output(output), cmds(cmds), dependencies(dependencies)
+{
+}
+
+void Target::build() const
+{
+    for (const auto &cmd : cmds)
+    {
+        cmd.run();
+    }
+}
+
+NBSAPI strvec parse_depfile(const std::string &content)
+{
+    strvec result;
+    std::string token;
+    bool in_deps = false;
+
+    auto flush = [&]() {
+        if (token.empty()) return;
+        if (!in_deps && token.back() == ':')
+        {
+            in_deps = true;
+            token.pop_back();
+        }
+        else if (in_deps)
+        {
+            result.emplace_back(token);
+        }
+        token.clear();
+    };
+
+    for (size_t i = 0; i < content.size(); i++)
+    {
+        char c = content[i];
+        if (c == '\\' && i + 1 < content.size())
+        {
+            char next = content[i + 1];
+            if (next == '\n' || next == '\r')
+            {
+                flush();
+                i++;
+                if (next == '\r' && i + 1 < content.size() && content[i + 1] == '\n') i++;
+                continue;
+            }
+            if (next == ' ' || next == '#')
+            {
+                token.push_back(next);
+                i++;
+                continue;
+            }
+        }
+        if (c == '$' && i + 1 < content.size() && content[i + 1] == '$')
+        {
+            token.push_back('$');
+            i++;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        {
+            flush();
+            // A new rule starts on the next line; -MMD writes only one.
+            if (c == '\n' && in_deps) break;
+            continue;
+        }
+        token.push_back(c);
+    }
+    flush();
+
+    return result;
+}
+
+uint64_t Target::cmd_hash() const
+{
+    uint64_t hash = hash::FNV_OFFSET_BASIS;
+    for (const auto &cmd : cmds)
+    {
+        for (const auto &item : cmd.items)
+        {
+            hash = hash::fnv1a(item.c_str(), item.size() + 1, hash);
+        }
+        hash = hash::fnv1a("\n", 1, hash);
+    }
+    return hash;
+}
+
+// Records are stored in host byte order:
+//   u32 size, str output, u64 cmd_hash, i64 mtime, u64 duration_us,
+//   u64 output_hash, u64 max_rss, u32 count, count * (str path, i64 mtime, u64 hash),
+//   u32 count, count * str dep
+// where str is a u32 length followed by the bytes.
+static const char BUILD_LOG_MAGIC[] = "NBSLOG";
+static const uint32_t BUILD_LOG_VERSION = 4;
+
+template <typename T>
+static void build_log_put(std::string &buf, T value)
+{
+    buf.append((const char *)&value, sizeof(value));
+}
+
+static void build_log_put_str(std::string &buf, const std::string &str)
+{
+    build_log_put<uint32_t>(buf, (uint32_t)str.size());
+    buf.append(str);
+}
+
+template <typename T>
+static bool build_log_get(const std::string &buf, size_t &pos, T &value)
+{
+    if (buf.size() - pos < sizeof(value)) return false;
+    memcpy(&value, buf.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+static bool build_log_get_str(const std::string &buf, size_t &pos, std::string &str)
+{
+    uint32_t size;
+    if (!build_log_get(buf, pos, size) || buf.size() - pos < size) return false;
+    str.assign(buf, pos, size);
+    pos += size;
+    return true;
+}
+
+static std::string build_log_record(const std::string &output, const BuildLogEntry &entry)
+{
+    std::string buf;
+    build_log_put_str(buf, output);
+    build_log_put<uint64_t>(buf, entry.cmd_hash);
+    build_log_put<int64_t>(buf, entry.mtime);
+    build_log_put<uint64_t>(buf, entry.duration_us);
+    build_log_put<uint64_t>(buf, entry.output_hash);
+    build_log_put<uint64_t>(buf, entry.max_rss);
+    build_log_put<uint32_t>(buf, (uint32_t)entry.inputs.size());
+    for (const auto &input : entry.inputs)
+    {
+        build_log_put_str(buf, input.path);
+        build_log_put<int64_t>(buf, input.mtime);
+        build_log_put<uint64_t>(buf, input.hash);
+    }
+    build_log_put<uint32_t>(buf, (uint32_t)entry.deps.size());
+    for (const auto &dep : entry.deps)
+    {
+        build_log_put_str(buf, dep);
+    }
+
+    std::string record;
+    build_log_put<uint32_t>(record, (uint32_t)buf.size());
+    return record + buf;
+}
+
+static bool build_log_parse(const std::string &buf, std::string &output, BuildLogEntry &entry)
+{
+    size_t pos = 0;
+    uint32_t count;
+
+    if (!build_log_get_str(buf, pos, output)) return false;
+    if (!build_log_get(buf, pos, entry.cmd_hash)) return false;
+    if (!build_log_get(buf, pos, entry.mtime)) return false;
+    if (!build_log_get(buf, pos, entry.duration_us)) return false;
+    if (!build_log_get(buf, pos, entry.output_hash)) return false;
+    if (!build_log_get(buf, pos, entry.max_rss)) return false;
+
+    if (!build_log_get(buf, pos, count)) return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        BuildLogInput input;
+        if (!build_log_get_str(buf, pos, input.path)) return false;
+        if (!build_log_get(buf, pos, input.mtime)) return false;
+        if (!build_log_get(buf, pos, input.hash)) return false;
+        entry.inputs.emplace_back(input);
+    }
+
+    if (!build_log_get(buf, pos, count)) return false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        std::string dep;
+        if (!build_log_get_str(buf, pos, dep)) return false;
+        entry.deps.emplace_back(dep);
+    }
+
+    return pos == buf.size();
+}
+
+const BuildLogEntry *BuildLog::find(const std::string &output) const
+{
+    auto it = entries.find(output);
+    return it == entries.end() ? nullptr : &it->second;
+}
+
+bool BuildLog::load(const os::path &path)
+{
+    entries.clear();
+    records = 0;
+
+    std::ifstream file(path.buf, std::ios::binary);
+    if (!file) return false;
+    std::string buf((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t pos = sizeof(BUILD_LOG_MAGIC);
+    uint32_t version;
+    if (buf.compare(0, sizeof(BUILD_LOG_MAGIC), BUILD_LOG_MAGIC, sizeof(BUILD_LOG_MAGIC)) != 0 ||
+        !build_log_get(buf, pos, version) || version != BUILD_LOG_VERSION)
+    {
+        log::warning("Discarding build log " + path.buf + " of an unknown version");
+        save(path);
+        return false;
+    }
+
+    // A truncated last record is left over from an interrupted build.
+    uint32_t size;
+    while (build_log_get(buf, pos, size) && buf.size() - pos >= size)
+    {
+        std::string output;
+        BuildLogEntry entry;
+        if (!build_log_parse(buf.substr(pos, size), output, entry)) break;
+        entries[output] = entry;
+        records++;
+        pos += size;
+    }
+
+    if (pos != buf.size() || (records > 100 && records > 3 * entries.size()))
+        save(path);
+
+    return true;
+}
+
+void BuildLog::save(const os::path &path) const
+{
+    os::path tmp = path.buf + ".tmp";
+    {
+        std::ofstream file(tmp.buf, std::ios::binary | std::ios::trunc);
+        file.write(BUILD_LOG_MAGIC, sizeof(BUILD_LOG_MAGIC));
+        file.write((const char *)&BUILD_LOG_VERSION, sizeof(BUILD_LOG_VERSION));
+        for (const auto &p : entries)
+        {
+            std::string record = build_log_record(p.first, p.second);
+            file.write(record.data(), record.size());
+        }
+    }
+    os::rename(tmp, path);
+}
+
+void BuildLog::append(const os::path &path, const std::string &output, const BuildLogEntry &entry)
+{
+    if (records == 0 && !os::exists(path))
+        save(path);
+
+    std::ofstream file(path.buf, std::ios::binary | std::ios::app);
+    std::string record = build_log_record(output, entry);
+    file.write(record.data(), record.size());
+
+    entries[output] = entry;
+    records++;
+}
+
+NBSAPI void write_trace(const os::path &path, const std::vector<TraceEvent> &events)
+{
+    std::ofstream file(path.buf, std::ios::trunc);
+    file << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const TraceEvent &event = events[i];
+        file << (i == 0 ? "\n" : ",\n");
+        file << "{\"name\":\"" << str::escape_json(event.name) << "\","
+             << "\"cat\":\"cmd\",\"ph\":\"X\","
+             << "\"ts\":" << event.start_us << ","
+             << "\"dur\":" << event.duration_us << ","
+             << "\"pid\":1,\"tid\":" << event.slot << ","
+             << "\"args\":{"
+             << "\"cmd\":\"" << str::escape_json(event.cmd) << "\","
+             << "\"exit_code\":" << event.status.exit_code << ","
+             << "\"signaled\":" << (event.status.signaled ? "true" : "false") << ","
+             << "\"cpu_time_us\":" << event.status.cpu_time_us << ","
+             << "\"max_rss\":" << event.status.max_rss << "}}";
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+static std::string format_duration(uint64_t us)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3fs", us / 1e6);
+    return buf;
+}
+
+NBSAPI void print_build_summary(const graph::DenseGraph<std::string> &graph, const std::vector<TargetTiming> &timings,
+                                uint64_t wall_us, size_t max_jobs)
+{
+    std::vector<size_t> built;
+    uint64_t busy_us = 0;
+    for (size_t node = 0; node < timings.size(); node++)
+    {
+        if (!timings[node].built) continue;
+        built.emplace_back(node);
+        busy_us += timings[node].end_us - timings[node].start_us;
+    }
+    if (built.empty()) return;
+
+    // The critical path ends at the target that finished last and follows,
+    // at every step, the dependency that finished last, i.e. the one that
+    // held the target back.
+    auto last = std::max_element(built.begin(), built.end(), [&](size_t a, size_t b) {
+        return timings[a].end_us < timings[b].end_us;
+    });
+    std::vector<size_t> path;
+    for (ptrdiff_t node = *last; node >= 0;)
+    {
+        path.emplace_back(node);
+        ptrdiff_t next = -1;
+        for (size_t e = graph.offsets[node]; e < graph.offsets[node + 1]; e++)
+        {
+            size_t dep = graph.edges[e];
+            if (!timings[dep].built) continue;
+            if (next < 0 || timings[dep].end_us > timings[next].end_us) next = dep;
+        }
+        node = next;
+    }
+
+    log::info("Critical path (" + format_duration(timings[path.front()].end_us - timings[path.back()].start_us) + "):");
+    for (auto it = path.rbegin(); it != path.rend(); it++)
+    {
+        const TargetTiming &t = timings[*it];
+        log::info("  " + format_duration(t.end_us - t.start_us) + " " + graph.names[*it]);
+    }
+
+    char parallelism[64];
+    snprintf(parallelism, sizeof(parallelism), "%.2f of %zu jobs", wall_us > 0 ? (double)busy_us / wall_us : 0.0, max_jobs);
+    log::info("Wall time " + format_duration(wall_us) + ", busy time " + format_duration(busy_us) +
+              ", parallelism " + parallelism);
+
+    std::sort(built.begin(), built.end(), [&](size_t a, size_t b) {
+        return timings[a].end_us - timings[a].start_us > timings[b].end_us - timings[b].start_us;
+    });
+    if (built.size() > 10) built.resize(10);
+    log::info("Slowest targets:");
+    for (size_t node : built)
+    {
+        log::info("  " + format_duration(timings[node].end_us - timings[node].start_us) + " " + graph.names[node]);
+    }
+}
+
+void TargetMap::insert(Target &target)
+{
+    targets.insert({target.output.buf, target});
+}
+
+bool TargetMap::remove(const std::string &target_output)
+{
+    return targets.erase(target_output) > 0;
+}
+
+void TargetMap::build(const std::string &output) const
+{
+    auto target_it = targets.find(output);
+    if (target_it == targets.end()) throw BUILD_NO_RULE_FOR_TARGET_ERROR;
+    auto target = target_it->second;
+
+    for (const auto &dep : target.dependencies)
+    {
+        if (os::exists(dep))
+            continue;
+
+        build(dep.buf);
+    }
+
+    target.build();
+}
+
+// Flags that take a path batch_cmd does not make absolute, or that write
+// files next to the object, which would stay in the batch directory.
+static const char *batch_unsafe_flags[] = {
+    "@", "-B", "--sysroot", "-isysroot", "-iprefix", "-iwithprefix", "-imultilib", "-specs", "--specs",
+    "-fplugin", "-fprofile-", "-fauto-profile", "--coverage", "-ftest-coverage", "-fsanitize-blacklist",
+    "-fsanitize-ignorelist", "-ffile-prefix-map", "-fdebug-prefix-map", "-fmacro-prefix-map",
+    "-fdump-", "-save-temps", "-gsplit-dwarf", "-fstack-usage", "-fcallgraph-info", "-ftime-trace"};
+
+// Compiles of the form "... -c ... -o <output> ... -MF <depfile> ... <source>"
+// with otherwise identical commands can share one compiler call.
+static bool batch_key(const Target &target, std::string &key)
+{
+    if (target.cmds.size() != 1 || target.source.buf.empty() || target.depfile.buf.empty()) return false;
+    const os::Cmd &cmd = target.cmds[0];
+    if (!cmd.cwd.buf.empty()) return false;
+
+    bool compile = false, output = false, depfile = false;
+    size_t sources = 0;
+    key = target.pool;
+    key += '\0';
+    for (size_t i = 0; i < cmd.items.size(); i++)
+    {
+        const std::string &item = cmd.items[i];
+        bool has_next = i + 1 < cmd.items.size();
+        for (const char *flag : batch_unsafe_flags)
+        {
+            if (item.compare(0, strlen(flag), flag) == 0) return false;
+        }
+        if (item == "-c") compile = true;
+        if (item == "-o" && has_next && cmd.items[i + 1] == target.output.buf)
+        {
+            output = true;
+            i++;
+            continue;
+        }
+        if (item == "-MF" && has_next && cmd.items[i + 1] == target.depfile.buf)
+        {
+            depfile = true;
+            i++;
+            continue;
+        }
+        if (item == target.source.buf)
+        {
+            sources++;
+            key += "<source>";
+        }
+        else
+        {
+            key += item;
+        }
+        key += '\0';
+    }
+    return compile && output && depfile && sources == 1;
+}
+
+// The compiler names each object after its source, without the extension.
+static std::string batch_stem(const Target &target)
+{
+    const std::string &source = target.source.buf;
+    size_t slash = source.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? source : source.substr(slash + 1);
+    return name.substr(0, name.find_last_of('.'));
+}
+
+// The working directory with a trailing separator, what os::absolute
+// puts in front of relative paths.
+static std::string batch_cwd_prefix()
+{
+    std::string prefix = os::absolute(".").buf;
+    if (!prefix.empty() && prefix.back() == '.') prefix.pop_back();
+    if (!prefix.empty() && prefix.back() != '/' && prefix.back() != '\\') prefix.push_back('/');
+    return prefix;
+}
+
+// One command compiling every source of the batch in dir. Relative paths
+// are made absolute since the compiler runs there, and mapped back in
+// __FILE__ and debug info, so each object is the same as when compiled
+// alone.
+static os::Cmd batch_cmd(const std::vector<const Target *> &batch, const os::path &dir)
+{
+    static const char *path_flags[] = {"-include-pch", "-idirafter", "-isystem", "-imacros",
+                                       "-include",     "-iquote",    "-I",       "-L"};
+    const Target &first = *batch[0];
+    const strvec &items = first.cmds[0].items;
+
+    os::Cmd cmd;
+    cmd.cwd = dir;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        const std::string &item = items[i];
+        if ((item == "-o" || item == "-MF") && i + 1 < items.size())
+        {
+            i++;
+            continue;
+        }
+        if (item == first.source.buf)
+        {
+            for (const Target *target : batch)
+                cmd.append(os::absolute(target->source).buf);
+            continue;
+        }
+
+        bool is_path = false;
+        for (const char *flag : path_flags)
+        {
+            size_t len = strlen(flag);
+            if (item == flag && i + 1 < items.size())
+            {
+                cmd.append(item);
+                cmd.append(os::absolute(items[++i]).buf);
+                is_path = true;
+                break;
+            }
+            if (item.size() > len && item.compare(0, len, flag) == 0)
+            {
+                cmd.append(flag + os::absolute(item.substr(len)).buf);
+                is_path = true;
+                break;
+            }
+        }
+        if (!is_path) cmd.append(item);
+    }
+
+    // The more specific map comes last, it wins for the compilation dir.
+    std::string prefix = batch_cwd_prefix();
+    cmd.append("-ffile-prefix-map=" + prefix + "=");
+    cmd.append("-fdebug-prefix-map=" + os::absolute(dir).buf + "=" + prefix.substr(0, prefix.size() - 1));
+    return cmd;
+}
+
+// The depfile of a batch member, with the paths that batch_cmd made
+// absolute relative again, as an unbatched compile would have written it.
+static std::string batch_depfile(const Target &target, const std::string &content)
+{
+    std::string prefix = batch_cwd_prefix();
+
+    auto escape = [](const std::string &path) {
+        std::string result;
+        for (char c : path)
+        {
+            if (c == ' ' || c == '#') result.push_back('\\');
+            if (c == '$') result.push_back('$');
+            result.push_back(c);
+        }
+        return result;
+    };
+
+    std::string result = escape(target.output.buf) + ":";
+    for (const auto &dep : parse_depfile(content))
+    {
+        bool inside = dep.compare(0, prefix.size(), prefix) == 0;
+        result += " \\\n  " + escape(inside ? dep.substr(prefix.size()) : dep);
+    }
+    return result + "\n";
+}
+
+#ifndef _WIN32
+// Jobs in their own process groups do not get the terminal's Ctrl-C, so
+// while a build runs we pass interrupts on to them ourselves.
+static const int job_signals[] = {SIGINT, SIGTERM, SIGHUP};
+static volatile sig_atomic_t job_interrupt = 0;
+static volatile sig_atomic_t *job_groups = nullptr; // by slot, 0 when free
+static size_t job_group_count = 0;
+
+static void forward_job_signal(int sig)
+{
+    job_interrupt = sig;
+    for (size_t i = 0; i < job_group_count; i++)
+    {
+        if (job_groups[i] > 0) kill(-job_groups[i], sig);
+    }
+}
+#endif
+
+// Forwards job_signals to the jobs of one build while it exists. Windows
+// delivers console Ctrl-C to every process anyway.
+struct JobSignals
+{
+#ifndef _WIN32
+    std::unique_ptr<volatile sig_atomic_t[]> groups;
+    struct sigaction old_actions[3];
+#endif
+    bool installed = false;
+
+    JobSignals(bool install, size_t slots)
+    {
+#ifdef _WIN32
+        (void)install;
+        (void)slots;
+#else
+        if (!install) return;
+        groups.reset(new volatile sig_atomic_t[slots]());
+        job_groups = groups.get();
+        job_group_count = slots;
+        job_interrupt = 0;
+        struct sigaction action{};
+        action.sa_handler = forward_job_signal;
+        sigemptyset(&action.sa_mask);
+        for (size_t i = 0; i < 3; i++) sigaction(job_signals[i], &action, &old_actions[i]);
+        installed = true;
+#endif
+    }
+
+    ~JobSignals()
+    {
+        restore();
+    }
+
+    void set(size_t slot, const os::Process &process)
+    {
+#ifdef _WIN32
+        (void)slot;
+        (void)process;
+#else
+        if (installed) groups[slot] = process.group ? process.pid : 0;
+#endif
+    }
+
+    void clear(size_t slot)
+    {
+#ifdef _WIN32
+        (void)slot;
+#else
+        if (installed) groups[slot] = 0;
+#endif
+    }
+
+    int interrupt() const
+    {
+#ifdef _WIN32
+        return 0;
+#else
+        return installed ? job_interrupt : 0;
+#endif
+    }
+
+    void restore()
+    {
+#ifndef _WIN32
+        if (!installed) return;
+        for (size_t i = 0; i < 3; i++) sigaction(job_signals[i], &old_actions[i], NULL);
+        job_groups = nullptr;
+        job_group_count = 0;
+        installed = false;
+#endif
+    }
+};
+
+void TargetMap::build_if_needs(const std::string &output) const
+{
+    auto target_it = targets.find(output);
+    if (target_it == targets.end()) throw BUILD_NO_RULE_FOR_TARGET_ERROR;
+
+    os::StatCache stats;
+    std::unordered_map<std::string, bool> dirty;
+    compute_dirty(output, dirty, stats);
+
+    if (!dirty[output])
+    {
+        log::info("'" + output + "' is up to date (" + std::to_string(stats.stat_calls) + " stat calls)");
+        return;
+    }
+
+    graph::DenseGraph<std::string> graph;
+    for (const auto &p : targets)
+    {
+        size_t from = graph.intern(p.first);
+        for (const auto &dep : dependency_names(p.second))
+        {
+            graph.add_edge(from, graph.intern(dep));
+        }
+    }
+    graph.finish();
+
+    graph::TopologicalOrder order;
+    try {
+        order = graph::topological_order(graph, {graph.ids[output]});
+    } catch (graph::GraphError e) {
+        switch (e)
+        {
+        case graph::CycleDependency:
+            throw BUILD_CYCLE_DEPENDENCY_ERROR;
+        case graph::VertexNotFound:
+            throw BUILD_NO_RULE_FOR_TARGET_ERROR;
+        default:
+            assert(0 && "Unreachable");
+        }
+    }
+
+    // Every dirty target waits for its dirty dependencies only, and starts
+    // as soon as the last of them is finished.
+    std::vector<const Target *> node_targets(graph.size(), nullptr);
+    std::vector<size_t> pending(graph.size(), 0);
+    std::vector<char> scheduled(graph.size(), 0);
+    std::vector<std::vector<size_t>> dependents(graph.size());
+
+    for (size_t node : order.order)
+    {
+        const std::string &name = graph.names[node];
+        auto t_search = targets.find(name);
+        if (t_search == targets.end())
+        {
+            if (!stats.exists(name)) throw BUILD_NO_RULE_FOR_TARGET_ERROR;
+            continue;
+        }
+        if (!dirty[name]) continue;
+
+        const std::string &pool = t_search->second.pool;
+        if (!pool.empty() && pools.find(pool) == pools.end())
+        {
+            log::error("Unknown pool '" + pool + "' for '" + name + "'");
+            throw BUILD_UNKNOWN_POOL_ERROR;
+        }
+
+        node_targets[node] = &t_search->second;
+        scheduled[node] = 1;
+        for (size_t e = graph.offsets[node]; e < graph.offsets[node + 1]; e++)
+        {
+            size_t dep = graph.edges[e];
+            if (!scheduled[dep]) continue;
+            dependents[dep].emplace_back(node);
+            pending[node]++;
+        }
+    }
+
+    // A target's priority is the length of the longest chain of recorded
+    // durations from it to the end of the build, so the targets that gate
+    // the most work start first. Targets without history get the average.
+    std::vector<uint64_t> priority(graph.size(), 0);
+    if (policy == SchedulePolicy::CriticalPath)
+    {
+        uint64_t known_sum = 0, known_count = 0;
+        for (size_t node : order.order)
+        {
+            if (!scheduled[node]) continue;
+            const BuildLogEntry *entry = build_log().find(graph.names[node]);
+            if (entry == nullptr || entry->duration_us == 0) continue;
+            priority[node] = entry->duration_us;
+            known_sum += entry->duration_us;
+            known_count++;
+        }
+        uint64_t estimate = known_count > 0 ? known_sum / known_count : 1;
+
+        for (auto it = order.order.rbegin(); it != order.order.rend(); it++)
+        {
+            size_t node = *it;
+            if (!scheduled[node]) continue;
+            uint64_t downstream = 0;
+            for (size_t dependent : dependents[node])
+            {
+                downstream = std::max(downstream, priority[dependent]);
+            }
+            priority[node] = (priority[node] > 0 ? priority[node] : estimate) + downstream;
+        }
+    }
+
+    std::priority_queue<std::pair<uint64_t, size_t>> ready;
+    uint64_t ready_count = 0;
+    auto make_ready = [&](size_t node) {
+        if (policy == SchedulePolicy::CriticalPath)
+            ready.push({priority[node], node});
+        else
+            ready.push({UINT64_MAX - ready_count++, node});
+    };
+
+    for (size_t node : order.order)
+    {
+        if (scheduled[node] && pending[node] == 0) make_ready(node);
+    }
+
+    struct Job
+    {
+        size_t node;
+        const Target *target;
+        size_t cmd_index;
+        os::Process process;
+        size_t slot;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point cmd_start;
+        std::vector<size_t> batch; // targets compiled together with this one
+        os::Cmd batch_cmd;
+        uint64_t expected_rss; // what the job was admitted with
+        uint64_t max_rss;      // measured over its commands so far
+    };
+
+    size_t max_jobs = jobs > 0 ? jobs : os::cpu_count();
+    std::vector<Job> running;
+    std::vector<char> unbatched(graph.size(), 0); // retried alone after a failed batch
+    os::ProcessGroup group;
+    size_t failures = 0;
+    bool stopped = false;    // no new jobs start
+    bool terminated = false; // the running jobs were told to stop
+
+    auto build_start = std::chrono::steady_clock::now();
+    auto since = [](std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    };
+    std::vector<char> slots(max_jobs, 0);
+    JobSignals signals(fail_fast, max_jobs);
+
+    // A parent make's jobserver limits us, and our own limits the children.
+    os::Jobserver tokens;
+    const char *makeflags = getenv("MAKEFLAGS");
+    if (!(makeflags != NULL && tokens.connect(makeflags)) && jobserver != os::JobserverMode::None)
+        tokens.serve(jobserver, max_jobs);
+    size_t total = std::count(scheduled.begin(), scheduled.end(), 1);
+    size_t finished = 0;
+    // With buffer_output commands write into pipes and their output is
+    // printed whole with a progress line once they finish, so parallel
+    // diagnostics never mix. With fail_fast a job gets its own process
+    // group, so terminating it also stops the compiler behind a shell or
+    // cc1plus behind the driver.
+    auto start_cmd = [&](const os::Cmd &cmd) {
+        if (!fail_fast) return buffer_output ? cmd.spawn(os::Capture::All) : cmd.run_async();
+        os::Cmd job_cmd = cmd;
+        job_cmd.new_group = true;
+        return buffer_output ? job_cmd.spawn(os::Capture::All) : job_cmd.run_async();
+    };
+
+    // Once enough jobs failed the build stops, and with fail_fast it does
+    // not wait for the running jobs to finish on their own.
+    auto fail = [&]() {
+        finished++;
+        failures++;
+        if (keep_going == 0 || failures < keep_going || stopped) return;
+        stopped = true;
+        if (!fail_fast || running.empty()) return;
+        log::info("Terminating " + std::to_string(running.size()) + " running jobs");
+        terminated = true;
+        for (const auto &job : running) job.process.terminate();
+    };
+    // The jobs already got the signal, the ones started just before it
+    // get SIGTERM.
+    auto check_interrupt = [&]() {
+        if (signals.interrupt() == 0 || terminated) return;
+        log::info("Interrupted, terminating " + std::to_string(running.size()) + " running jobs");
+        stopped = true;
+        terminated = true;
+        for (const auto &job : running) job.process.terminate();
+    };
+    auto have_token = [&]() {
+        return !tokens.active() || running.size() <= tokens.tokens.size() || tokens.acquire();
+    };
+    std::vector<TraceEvent> trace;
+    std::vector<TargetTiming> timings(graph.size());
+
+    std::unique_ptr<cache::Cache> output_cache;
+    if (!cache_dir.buf.empty())
+    {
+        output_cache = std::make_unique<cache::Cache>(cache_dir);
+        output_cache->max_size = cache_max_size;
+        output_cache->hard_link = cache_hard_link;
+    }
+
+    auto release = [&](size_t node) {
+        finished++;
+        const Target *t = node_targets[node];
+        dirty[t->output.buf] = false;
+        stats.invalidate(t->output);
+        if (output_cache) output_cache->invalidate(t->output.buf);
+
+        for (size_t dependent : dependents[node])
+        {
+            if (--pending[dependent] == 0) make_ready(dependent);
+        }
+    };
+
+    auto complete = [&](size_t node, uint64_t start_us, uint64_t duration_us, uint64_t max_rss) {
+        record_build(*node_targets[node], duration_us, max_rss);
+        timings[node] = TargetTiming{true, start_us, start_us + duration_us};
+        release(node);
+    };
+
+    // Ready targets of a full pool wait there, without holding up others.
+    std::unordered_map<std::string, size_t> pool_used;
+    std::unordered_map<std::string, std::vector<std::pair<uint64_t, size_t>>> pool_waiting;
+    auto pool_full = [&](const Target *t) {
+        if (t->pool.empty()) return false;
+        size_t limit = pools.at(t->pool);
+        return limit > 0 && pool_used[t->pool] >= limit;
+    };
+    // Jobs are admitted while the peak memory they needed last time fits
+    // into the budget; targets without history are assumed average.
+    uint64_t memory_limit = memory_budget > 0 ? memory_budget : os::memory_limit();
+    std::vector<uint64_t> expected_rss(graph.size(), 0);
+    if (memory_limit > 0)
+    {
+        uint64_t known_sum = 0, known_count = 0;
+        for (size_t node : order.order)
+        {
+            if (!scheduled[node]) continue;
+            const BuildLogEntry *entry = build_log().find(graph.names[node]);
+            if (entry == nullptr || entry->max_rss == 0) continue;
+            expected_rss[node] = entry->max_rss;
+            known_sum += entry->max_rss;
+            known_count++;
+        }
+        uint64_t estimate = known_count > 0 ? known_sum / known_count : 0;
+        for (auto &rss : expected_rss)
+        {
+            if (rss == 0) rss = estimate;
+        }
+    }
+    uint64_t memory_used = 0;
+    bool memory_full = false;
+
+    auto free_job = [&](const Job &job) {
+        slots[job.slot] = 0;
+        memory_used -= job.expected_rss;
+        memory_full = false;
+        const std::string &pool = job.target->pool;
+        if (pool.empty()) return;
+        pool_used[pool]--;
+        for (const auto &item : pool_waiting[pool]) ready.push(item);
+        pool_waiting[pool].clear();
+    };
+
+    // Targets that are done without running anything, because their
+    // inputs did not really change or the cache has their output.
+    std::vector<char> checked(graph.size(), 0);
+    auto skip = [&](size_t node) {
+        if (checked[node]) return false;
+        checked[node] = 1;
+        const Target *t = node_targets[node];
+
+        // The dependencies are up to date now; if none of them changed
+        // its content, neither does this target.
+        if (restat && !is_dirty(*t, dirty, stats))
+        {
+            log::info("UNCHANGED: " + t->output.buf);
+            const BuildLogEntry *entry = build_log().find(t->output.buf);
+            record_build(*t, entry ? entry->duration_us : 0, entry ? entry->max_rss : 0);
+            release(node);
+            return true;
+        }
+
+        if (output_cache && cache::is_cacheable(*t) && output_cache->fetch(*t))
+        {
+            log::info("CACHED: " + t->output.buf);
+            // Keep the compile time in the log for scheduling.
+            const BuildLogEntry *entry = build_log().find(t->output.buf);
+            complete(node, since(build_start, std::chrono::steady_clock::now()), entry ? entry->duration_us : 0,
+                     entry ? entry->max_rss : 0);
+            return true;
+        }
+        return false;
+    };
+
+    while (!running.empty() || (!ready.empty() && !stopped))
+    {
+        check_interrupt();
+        bool overloaded = false;
+        while (!stopped && !memory_full && !ready.empty() && running.size() < max_jobs && have_token())
+        {
+            if (max_load > 0 && !running.empty() && os::system_load() >= max_load)
+            {
+                overloaded = true;
+                break;
+            }
+
+            auto top = ready.top();
+            size_t node = top.second;
+            ready.pop();
+            if (skip(node)) continue;
+            const Target *t = node_targets[node];
+            if (pool_full(t))
+            {
+                pool_waiting[t->pool].push_back(top);
+                continue;
+            }
+
+            // The most important target waits for memory rather than being
+            // overtaken, so a big job is not starved by small ones. A job
+            // always runs when nothing else does.
+            if (memory_limit > 0 && !running.empty() && memory_used + expected_rss[node] > memory_limit)
+            {
+                ready.push(top);
+                memory_full = true;
+                break;
+            }
+
+            // Take other ready compiles with the same flags along, but leave
+            // enough ready work for the other free slots.
+            std::vector<size_t> batch{node};
+            std::string key;
+            if (compile_batch > 1 && !unbatched[node] && batch_key(*t, key))
+            {
+                size_t free_slots = max_jobs - running.size();
+                size_t limit = std::min(compile_batch, (ready.size() + free_slots) / free_slots);
+                std::unordered_set<std::string> stems{batch_stem(*t)};
+                std::vector<std::pair<uint64_t, size_t>> others;
+                while (batch.size() < limit && !ready.empty())
+                {
+                    auto item = ready.top();
+                    ready.pop();
+                    if (skip(item.second)) continue;
+
+                    std::string other_key;
+                    const Target *other = node_targets[item.second];
+                    if (!unbatched[item.second] && batch_key(*other, other_key) && other_key == key &&
+                        stems.insert(batch_stem(*other)).second)
+                        batch.push_back(item.second);
+                    else
+                        others.push_back(item);
+                }
+                for (const auto &item : others) ready.push(item);
+            }
+
+            size_t slot = std::find(slots.begin(), slots.end(), 0) - slots.begin();
+            try {
+                auto now = std::chrono::steady_clock::now();
+                os::Cmd cmd;
+                if (batch.size() > 1)
+                {
+                    std::vector<const Target *> members;
+                    for (size_t member : batch) members.push_back(node_targets[member]);
+
+                    const std::string &out = t->output.buf;
+                    size_t slash = out.find_last_of("/\\");
+                    os::path dir = os::path(slash == std::string::npos ? "." : out.substr(0, slash)) /
+                                   (".nbs_batch_" + std::to_string(slot));
+                    os::make_directory_if_not_exists(dir);
+                    // Left over from an interrupted build, they would pass
+                    // for this batch's output.
+                    for (const Target *member : members)
+                    {
+                        os::remove(dir / (batch_stem(*member) + ".o"));
+                        os::remove(dir / (batch_stem(*member) + ".d"));
+                    }
+                    cmd = batch_cmd(members, dir);
+                }
+                // Outputs restored as hard links share their inode with a
+                // cache entry, also once the cache is turned off. Compilers
+                // and shell redirections write in place, so such links are
+                // broken before the commands run.
+                if (batch.size() == 1)
+                {
+                    if (os::link_count(t->output) > 1) os::remove(t->output);
+                    if (!t->depfile.buf.empty() && os::link_count(t->depfile) > 1) os::remove(t->depfile);
+                }
+                os::Process p = start_cmd(batch.size() > 1 ? cmd : t->cmds[0]);
+                group.add(p);
+                signals.set(slot, p);
+                slots[slot] = 1;
+                if (!t->pool.empty()) pool_used[t->pool]++;
+                uint64_t rss = 0;
+                for (size_t member : batch) rss = std::max(rss, expected_rss[member]);
+                memory_used += rss;
+                running.push_back(Job{node, t, 0, p, slot, now, now, batch, cmd, rss, 0});
+            } catch (os::ProcessError e) {
+                if (batch.size() == 1)
+                {
+                    fail();
+                    continue;
+                }
+                // The members were already taken off ready, each one is
+                // started on its own instead.
+                for (size_t member : batch)
+                {
+                    unbatched[member] = 1;
+                    make_ready(member);
+                }
+            }
+        }
+
+        if (running.empty()) break;
+
+        // Every running job but the first holds a token.
+        while (!tokens.tokens.empty() && tokens.tokens.size() >= running.size()) tokens.release();
+
+        // With work waiting for a token or for the load to drop, wake up for
+        // whichever comes first.
+        if ((tokens.active() || overloaded) && !stopped && !memory_full && !ready.empty() &&
+            running.size() < max_jobs)
+        {
+            while (!group.any_exited() && !tokens.wait(10) && !(overloaded && os::system_load() < max_load))
+            {
+            }
+            if (!group.any_exited()) continue;
+        }
+
+        os::ProcessStatus status = [&]() {
+            try {
+                return group.wait_any();
+            } catch (os::ProcessError e) {
+                throw BUILD_CMD_ERROR;
+            }
+        }();
+
+        auto job_it = std::find_if(running.begin(), running.end(),
+                                   [&](const Job &j) { return j.process == status.process; });
+        Job job = *job_it;
+        running.erase(job_it);
+        signals.clear(job.slot);
+        check_interrupt();
+        job.max_rss = std::max(job.max_rss, status.max_rss);
+
+        auto now = std::chrono::steady_clock::now();
+        const os::Cmd &job_cmd = job.batch.size() > 1 ? job.batch_cmd : job.target->cmds[job.cmd_index];
+        if (!trace_path.buf.empty())
+        {
+            std::string name = job.target->output.buf;
+            for (size_t i = 1; i < job.batch.size(); i++) name += " " + node_targets[job.batch[i]]->output.buf;
+            trace.push_back(TraceEvent{name, job_cmd.to_string(), since(build_start, job.cmd_start),
+                                       since(job.cmd_start, now), job.slot, status});
+        }
+
+        // Members of a failed batch that produced no object are compiled
+        // on their own, which reports and counts each failure separately.
+        bool batch_failed = job.batch.size() > 1 && !status.success() && !terminated;
+        if (batch_failed)
+        {
+            std::string names;
+            for (size_t member : job.batch) names += " " + node_targets[member]->output.buf;
+            log::info("Batch failed, keeping the objects it produced:" + names);
+        }
+        else if (buffer_output && !(terminated && !status.success()))
+        {
+            std::string progress = "[" + std::to_string(std::min(finished + job.batch.size(), total)) + "/" +
+                                   std::to_string(total) + "] ";
+            if (status.success())
+                log::info(progress + job_cmd.to_string());
+            else
+                log::error(progress + "FAILED: " + job.target->output.buf + "\n" + job_cmd.to_string());
+            if (!status.output.empty())
+            {
+                std::cout << status.output;
+                if (status.output.back() != '\n') std::cout << '\n';
+            }
+            std::cout << std::flush;
+        }
+
+        if (!status.success() && !batch_failed)
+        {
+            free_job(job);
+            // Like make on an interrupt, do not leave half written outputs.
+            if (terminated)
+                os::remove(job.target->output);
+            else
+                fail();
+            continue;
+        }
+
+        if (job.cmd_index + 1 < job.target->cmds.size())
+        {
+            if (stopped)
+            {
+                free_job(job);
+                continue;
+            }
+
+            job.cmd_index++;
+            job.cmd_start = now;
+            try {
+                job.process = start_cmd(job.target->cmds[job.cmd_index]);
+                group.add(job.process);
+                signals.set(job.slot, job.process);
+                running.push_back(job);
+            } catch (os::ProcessError e) {
+                free_job(job);
+                fail();
+            }
+            continue;
+        }
+
+        free_job(job);
+        if (job.batch.size() > 1)
+        {
+            // Move every object and depfile from the batch directory into place.
+            uint64_t share = since(job.start, now) / job.batch.size();
+            for (size_t member : job.batch)
+            {
+                const Target *t = node_targets[member];
+                os::path stem = job.batch_cmd.cwd / batch_stem(*t);
+                if (batch_failed && !os::exists(stem.buf + ".o"))
+                {
+                    os::remove(stem.buf + ".d");
+                    unbatched[member] = 1;
+                    make_ready(member);
+                    continue;
+                }
+
+                std::string depfile;
+                if (!os::read_file(stem.buf + ".d", depfile) ||
+                    !os::write_file(t->depfile, batch_depfile(*t, depfile)) ||
+                    std::rename((stem.buf + ".o").c_str(), t->output.buf.c_str()) != 0)
+                {
+                    log::error("Could not move " + stem.buf + ".o to " + t->output.buf);
+                    fail();
+                    continue;
+                }
+                os::remove(stem.buf + ".d");
+                if (output_cache && cache::is_cacheable(*t)) output_cache->store(*t);
+                complete(member, since(build_start, job.start), share, job.max_rss);
+            }
+            continue;
+        }
+
+        if (output_cache && cache::is_cacheable(*job.target)) output_cache->store(*job.target);
+        complete(job.node, since(build_start, job.start), since(job.start, now), job.max_rss);
+    }
+
+    if (output_cache) output_cache->finish();
+    if (!trace_path.buf.empty()) write_trace(trace_path, trace);
+    if (summary) print_build_summary(graph, timings, since(build_start, std::chrono::steady_clock::now()), max_jobs);
+
+    // Die of the signal like the jobs did, or throw if it is handled.
+    int interrupt = signals.interrupt();
+    if (interrupt != 0)
+    {
+        signals.restore();
+        std::cout << std::flush;
+        raise(interrupt);
+        throw BUILD_CMD_ERROR;
+    }
+
+    if (failures > 0)
+    {
+        log::error(std::to_string(failures) + (failures == 1 ? " job" : " jobs") + " failed");
+        throw BUILD_CMD_ERROR;
+    }
+}
+
+void TargetMap::record_build(const Target &target, uint64_t duration_us, uint64_t max_rss) const
+{
+    if (log_path.buf.empty()) return;
+
+    BuildLogEntry entry;
+    entry.cmd_hash = target.cmd_hash();
+    entry.mtime = os::last_write_time(target.output);
+    entry.duration_us = duration_us;
+    entry.max_rss = max_rss;
+    if (restat) hash::file(target.output, entry.output_hash);
+    for (const auto &dep : target.dependencies)
+    {
+        int64_t mtime = os::last_write_time(dep);
+        entry.inputs.push_back(BuildLogInput{dep.buf, mtime, restat ? recorded_hash(dep.buf, mtime) : 0});
+    }
+    if (!target.depfile.buf.empty())
+    {
+        std::ifstream depfile(target.depfile.buf);
+        std::stringstream content;
+        content << depfile.rdbuf();
+        for (const auto &dep : parse_depfile(content.str()))
+        {
+            auto declared = std::find_if(target.dependencies.begin(), target.dependencies.end(),
+                                         [&](const os::path &p) { return p.buf == dep; });
+            if (declared == target.dependencies.end())
+                entry.deps.emplace_back(dep);
+        }
+    }
+    build_log().append(log_path, target.output.buf, entry);
+}
+
+bool TargetMap::needs_rebuild(const os::path &output) const
+{
+    if (targets.find(output.buf) == targets.end())
+        TODO("needs_rebuild error handling");
+
+    os::StatCache stats;
+    std::unordered_map<std::string, bool> dirty;
+    compute_dirty(output.buf, dirty, stats);
+    return dirty[output.buf];
+}
+
+strvec TargetMap::dependency_names(const Target &target) const
+{
+    strvec result = os::paths_to_strs(target.dependencies);
+
+    // Discovered dependencies that are built by other targets, such as
+    // generated headers, have to be built first.
+    const BuildLogEntry *entry = build_log().find(target.output.buf);
+    if (entry != nullptr)
+    {
+        for (const auto &dep : entry->deps)
+        {
+            if (targets.find(dep) != targets.end())
+                result.emplace_back(dep);
+        }
+    }
+
+    return result;
+}
+
+// Computes dirtiness of output and everything it depends on in a single
+// post-order walk. Nodes already present in dirty are not visited again.
+void TargetMap::compute_dirty(const std::string &output, std::unordered_map<std::string, bool> &dirty,
+                              os::StatCache &stats) const
+{
+    struct Frame
+    {
+        const Target *target;
+        strvec children;
+        size_t next;
+    };
+
+    std::vector<Frame> stack;
+    std::unordered_set<std::string> visiting;
+
+    auto visit = [&](const std::string &name) {
+        if (dirty.find(name) != dirty.end()) return;
+
+        auto it = targets.find(name);
+        if (it == targets.end())
+        {
+            dirty[name] = false;
+            return;
+        }
+
+        if (!visiting.insert(name).second) throw BUILD_CYCLE_DEPENDENCY_ERROR;
+        stack.push_back(Frame{&it->second, dependency_names(it->second), 0});
+    };
+
+    visit(output);
+    while (!stack.empty())
+    {
+        Frame &frame = stack.back();
+        if (frame.next < frame.children.size())
+        {
+            std::string child = frame.children[frame.next++];
+            visit(child);
+            continue;
+        }
+
+        const Target &target = *frame.target;
+        dirty[target.output.buf] = is_dirty(target, dirty, stats);
+        visiting.erase(target.output.buf);
+        stack.pop_back();
+    }
+}
+
+// Expects every dependency of target to be present in dirty already.
+bool TargetMap::is_dirty(const Target &target, const std::unordered_map<std::string, bool> &dirty,
+                         os::StatCache &stats) const
+{
+    const os::path &output = target.output;
+    if (!stats.exists(output)) return true;
+    int64_t output_mtime = stats.last_write_time(output);
+
+    // Inputs the build log vouches for need no timestamp comparison.
+    std::unordered_set<std::string> unchanged;
+
+    auto is_dirty_target = [&](const std::string &name) {
+        auto it = dirty.find(name);
+        return targets.find(name) != targets.end() && it != dirty.end() && it->second;
+    };
+
+    if (!log_path.buf.empty())
+    {
+        // Without a record nbs cannot tell which commands produced the
+        // output, so it is rebuilt once to get one.
+        const BuildLogEntry *entry = build_log().find(output.buf);
+        if (entry == nullptr || entry->cmd_hash != target.cmd_hash()) return true;
+
+        // An input that changed since the last build makes the output stale
+        // even when it is not newer, e.g. after checking out an older revision.
+        // With restat, an input rewritten with the same content is unchanged.
+        for (const auto &input : entry->inputs)
+        {
+            if (!stats.exists(input.path)) return true;
+            int64_t mtime = stats.last_write_time(input.path);
+            if (mtime != input.mtime &&
+                !(restat && input.hash != 0 && recorded_hash(input.path, mtime) == input.hash))
+                return true;
+            unchanged.insert(input.path);
+        }
+
+        // A discovered dependency that is gone, e.g. a removed header, has
+        // to be rediscovered by running the commands again.
+        for (const auto &dep : entry->deps)
+        {
+            if (is_dirty_target(dep)) return true;
+            if (!stats.exists(dep) || output_mtime < stats.last_write_time(dep)) return true;
+        }
+    }
+
+    for (const auto &dep : target.dependencies)
+    {
+        bool is_target = targets.find(dep.buf) != targets.end();
+        if (is_dirty_target(dep.buf)) return true;
+        if (!stats.exists(dep))
+        {
+            if (is_target) return true;
+            continue;
+        }
+        if (unchanged.find(dep.buf) != unchanged.end()) continue;
+        if (output_mtime < stats.last_write_time(dep)) return true;
+    }
+    return false;
+}
+
+// Content hash of path as recorded when it was built, if the record
+// describes the file as it is now; 0 otherwise.
+uint64_t TargetMap::recorded_hash(const std::string &path, int64_t mtime) const
+{
+    const BuildLogEntry *entry = build_log().find(path);
+    if (entry == nullptr || entry->mtime != mtime) return 0;
+    return entry->output_hash;
+}
+
+BuildLog &TargetMap::build_log() const
+{
+    if (!log_loaded && !log_path.buf.empty())
+        log.load(log_path);
+    log_loaded = true;
+    return log;
+}
+} // namespace target
+
+namespace cache
+{
+Cache::Cache(const os::path &root)
+    : root(root)
+{
+}
+
+os::path Cache::entry_path(const std::string &key, const std::string &extension) const
+{
+    return root / key.substr(0, 2) / (key + extension);
+}
+
+bool Cache::file_hash(const std::string &path, uint64_t &hash)
+{
+    auto it = file_hashes.find(path);
+    if (it != file_hashes.end())
+    {
+        hash = it->second;
+        return true;
+    }
+
+    if (!hash::file(path, hash)) return false;
+    file_hashes[path] = hash;
+    return true;
+}
+
+std::string Cache::compiler_id(const std::string &compiler)
+{
+    auto it = compiler_ids.find(compiler);
+    if (it != compiler_ids.end()) return it->second;
+
+    // Like ccache's default compiler_check: a rebuilt or upgraded compiler
+    // changes its size or mtime.
+    std::string resolved = os::find_executable(compiler);
+    os::FileStat st = os::stat_file(resolved);
+    std::string id = resolved + ":" + std::to_string(st.size) + ":" + std::to_string(st.mtime);
+    compiler_ids[compiler] = id;
+    return id;
+}
+
+std::string Cache::manifest_key(const target::Target &target)
+{
+    uint64_t source_hash;
+    if (!file_hash(target.source.buf, source_hash)) return "";
+
+    const os::Cmd &cmd = target.cmds[0];
+    uint64_t hash = hash::fnv1a("nbs compiler cache 1");
+    hash = hash::fnv1a(compiler_id(cmd.items[0]), hash);
+    for (const auto &item : cmd.items)
+    {
+        // Where the object and depfile go does not change the object.
+        std::string normalized = item == target.output.buf    ? "<output>"
+                                 : item == target.depfile.buf ? "<depfile>"
+                                                              : item;
+        hash = hash::fnv1a(normalized.c_str(), normalized.size() + 1, hash);
+    }
+    hash = hash::fnv1a(&source_hash, sizeof(source_hash), hash);
+
+    // Declared inputs such as a precompiled header affect the object too,
+    // but do not show up in the depfile.
+    for (const auto &dep : target.dependencies)
+    {
+        if (dep.buf == target.source.buf) continue;
+        uint64_t dep_hash;
+        if (!file_hash(dep.buf, dep_hash)) return "";
+        hash = hash::fnv1a(dep.buf.c_str(), dep.buf.size() + 1, hash);
+        hash = hash::fnv1a(&dep_hash, sizeof(dep_hash), hash);
+    }
+
+    return hash::to_hex(hash);
+}
+
+bool Cache::object_key(const std::string &manifest_key, const strvec &headers, std::string &key)
+{
+    uint64_t hash = hash::fnv1a(manifest_key);
+    for (const auto &header : headers)
+    {
+        uint64_t header_hash;
+        if (!file_hash(header, header_hash)) return false;
+        hash = hash::fnv1a(header.c_str(), header.size() + 1, hash);
+        hash = hash::fnv1a(&header_hash, sizeof(header_hash), hash);
+    }
+    key = hash::to_hex(hash);
+    return true;
+}
+
+std::string Cache::action_key(const target::Target &target)
+{
+    uint64_t hash = hash::fnv1a("nbs action cache 1");
+    for (const auto &cmd : target.cmds)
+    {
+        for (const auto &item : cmd.items)
+        {
+            hash = hash::fnv1a(item.c_str(), item.size() + 1, hash);
+        }
+        hash = hash::fnv1a("\n", 1, hash);
+    }
+    for (const auto &dep : target.dependencies)
+    {
+        uint64_t dep_hash;
+        if (!file_hash(dep.buf, dep_hash)) return "";
+        hash = hash::fnv1a(dep.buf.c_str(), dep.buf.size() + 1, hash);
+        hash = hash::fnv1a(&dep_hash, sizeof(dep_hash), hash);
+    }
+    return hash::to_hex(hash);
+}
+
+bool Cache::restore(const os::path &entry, const os::path &output, bool link)
+{
+    if (!(link && os::hard_link(entry, output)) && !os::copy_file(entry, output)) return false;
+
+    // Marks the entry as recently used, unless it is linked into a checkout
+    // (this one or another): that would bump the mtime of those outputs too.
+    // Linked entries age from when they were stored; the build log still
+    // notices that such an output changed, as its mtime differs.
+    if (os::link_count(entry) <= 1) os::touch(entry);
+    return true;
+}
+
+bool Cache::fetch(const target::Target &target)
+{
+    bool restored = false;
+    if (is_compile(target))
+    {
+        std::string mkey = manifest_key(target);
+        std::string manifest;
+        std::string key;
+        if (!mkey.empty() && os::read_file(entry_path(mkey, ".manifest"), manifest) &&
+            object_key(mkey, manifest.empty() ? strvec{} : str::split(manifest, "\n"), key) &&
+            os::exists(entry_path(key, ".o")))
+        {
+            // Compilers rewrite depfiles in place, so they are never linked.
+            restored = restore(entry_path(key, ".o"), target.output, hard_link) &&
+                       restore(entry_path(key, ".d"), target.depfile, false);
+            if (restored) os::touch(entry_path(mkey, ".manifest"));
+        }
+    }
+    else
+    {
+        std::string key = action_key(target);
+        restored = !key.empty() && os::exists(entry_path(key, ".out")) &&
+                   restore(entry_path(key, ".out"), target.output, hard_link);
+    }
+
+    if (!restored)
+    {
+        stats.misses++;
+        return false;
+    }
+
+    stats.hits++;
+    return true;
+}
+
+void Cache::store(const target::Target &target)
+{
+    if (!is_compile(target))
+    {
+        std::string key = action_key(target);
+        if (key.empty()) return;
+        os::make_directory_if_not_exists(root);
+        os::make_directory_if_not_exists(root / key.substr(0, 2));
+        if (os::copy_file(target.output, entry_path(key, ".out"))) stored = true;
+        return;
+    }
+
+    std::string mkey = manifest_key(target);
+    std::string depfile;
+    if (mkey.empty() || !os::read_file(target.depfile, depfile)) return;
+
+    strvec headers;
+    for (const auto &dep : target::parse_depfile(depfile))
+    {
+        if (dep != target.source.buf) headers.emplace_back(dep);
+    }
+
+    std::string key;
+    if (!object_key(mkey, headers, key)) return;
+
+    os::make_directory_if_not_exists(root);
+    os::make_directory_if_not_exists(root / key.substr(0, 2));
+    os::make_directory_if_not_exists(root / mkey.substr(0, 2));
+
+    // The manifest goes last, so a concurrent fetch never finds a manifest
+    // that points to a missing object.
+    if (!os::write_file(entry_path(key, ".d"), depfile)) return;
+    if (!os::copy_file(target.output, entry_path(key, ".o"))) return;
+    if (!os::write_file(entry_path(mkey, ".manifest"), str::join("\n", headers))) return;
+    stored = true;
+}
+
+void Cache::invalidate(const std::string &path)
+{
+    file_hashes.erase(path);
+}
+
+void Cache::finish()
+{
+    if (stats.hits + stats.misses == 0) return;
+
+    // Totals over all builds that used this cache directory. The lock keeps
+    // concurrent builds from losing each other's counts.
+    os::make_directory_if_not_exists(root);
+    os::path lock_path = root / "stats.lock";
+#if _WIN32
+    HANDLE lock = CreateFile(lock_path.buf.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    OVERLAPPED overlapped{};
+    if (lock != INVALID_HANDLE_VALUE) LockFileEx(lock, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+#else
+    int lock = open(lock_path.buf.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (lock >= 0)
+    {
+        while (flock(lock, LOCK_EX) != 0 && errno == EINTR)
+        {
+        }
+    }
+#endif
+
+    CacheStats total = stats;
+    std::string content;
+    if (os::read_file(root / "stats", content))
+    {
+        strvec lines = str::split(content, "\n");
+        if (lines.size() >= 2)
+        {
+            total.hits += std::strtoull(lines[0].c_str(), NULL, 10);
+            total.misses += std::strtoull(lines[1].c_str(), NULL, 10);
+        }
+    }
+    os::write_file(root / "stats", std::to_string(total.hits) + "\n" + std::to_string(total.misses) + "\n");
+
+#if _WIN32
+    if (lock != INVALID_HANDLE_VALUE) CloseHandle(lock);
+#else
+    if (lock >= 0) close(lock);
+#endif
+
+    log::info("Cache: " + std::to_string(stats.hits) + " hits, " + std::to_string(stats.misses) +
+              " misses (" + std::to_string(total.hits) + " hits, " + std::to_string(total.misses) + " misses in total)");
+
+    if (!stored) return;
+
+    struct Entry
+    {
+        os::path path;
+        int64_t mtime;
+        uint64_t size;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t size = 0;
+    for (const auto &dir : os::list_directory(root))
+    {
+        if (dir.size() != 2) continue;
+        for (const auto &name : os::list_directory(root / dir))
+        {
+            os::path path = root / dir / name;
+            os::FileStat st = os::stat_file(path);
+            entries.push_back(Entry{path, st.mtime, st.size});
+            size += st.size;
+        }
+    }
+    if (size <= max_size) return;
+
+    // Least recently used first; stop at 90% to not evict on every build.
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+    size_t evicted = 0;
+    for (const auto &entry : entries)
+    {
+        if (size <= max_size / 10 * 9) break;
+        if (!os::remove(entry.path)) continue;
+        size -= entry.size;
+        evicted++;
+    }
+    log::info("Cache: evicted " + std::to_string(evicted) + " files");
+}
+
+NBSAPI bool is_compile(const target::Target &target)
+{
+    return !target.source.buf.empty() && !target.depfile.buf.empty() && target.cmds.size() == 1;
+}
+
+NBSAPI bool is_cacheable(const target::Target &target)
+{
+    return is_compile(target) || (target.cacheable && !target.cmds.empty());
+}
+} // namespace cache
+
+namespace c {
+static CDefaults cdefaults;
+
+NBSAPI std::string comp_str(Compiler comp)
+{
+    switch (comp)
+    {
+    case Compiler::CC:
+        return "cc";
+    case Compiler::CXX:
+        return "c++";
+    case Compiler::GCC:
+        return "gcc";
+    case Compiler::GXX:
+        return "g++";
+    case Compiler::CLANG:
+        return "clang";
+    case Compiler::CLANGXX:
+        return "clang++";
+    case Compiler::MSVC:
+        return "cl.exe";
+    default:
+        return "UNKNOWN COMPILER";
+    }
+}
+
+NBSAPI Compiler current_compiler()
+{
+//  Clang C++ emulates GCC, so it has to appear early.
+#if defined __clang__ && !defined(__ibmxl__) && !defined(__CODEGEARC__)
+    return Compiler::CLANGXX;
+
+// MINGW32
+#elif defined(__MINGW32__)
+    TODO("mingw")
+
+//  GNU C++:
+#elif defined(__GNUC__) && !defined(__ibmxl__)
+    return Compiler::GXX;
+
+//  Microsoft Visual C++
+#elif defined _MSC_VER
+    return Compiler::MSVC;
+#endif
+
+    TODO("Unknown compiler");
+}
+
+NBSAPI CDefaults *get_cdefaults()
+{
+    return &cdefaults;
+}
+
+os::Cmd CompileOptions::cmd(const os::pathvec &sources, const strvec &additional_flags) const
+{
+    // TODO: fucking windows pain
+    os::Cmd cmd;
+
+    cmd.append(comp_str(compiler));
+    if (!standard.empty())
+        cmd.append("-std=" + standard);
+
+    cmd.append_many(additional_flags);
+
+    cmd.append_many(flags);
+    cmd.append_many_prefixed("-I", os::paths_to_strs(include_paths));
+    cmd.append_many_prefixed("-D", defines);
+    cmd.append_many(other_flags);
+
+    cmd.append_many(os::paths_to_strs(sources));
+
+    cmd.append_many_prefixed("-L", os::paths_to_strs(lib_paths));
+    cmd.append_many_prefixed("-l", os::paths_to_strs(libs));
+
+    return cmd;
+}
+
+os::Cmd CompileOptions::exe_cmd(const os::path &output, const os::pathvec &sources) const
+{
+    strvec additional_flags;
+    if (compiler == Compiler::MSVC)
+    {
+        additional_flags.emplace_back("-Fe:" + output.buf);
+    }
+    else
+    {
+        additional_flags.emplace_back("-o");
+        additional_flags.emplace_back(output.buf);
+    }
+
+    return this->cmd(sources, additional_flags);
+}
+
+// TODO: /Yc and /Yu, which create the PCH from a source file that must
+// also be linked in
+static void unsupported_msvc_pch()
+{
+    log::error("Precompiled headers are not supported for MSVC");
+    throw COMPILE_UNSUPPORTED_ERROR;
+}
+
+os::Cmd CompileOptions::obj_cmd(const os::path &output, const os::path &source) const
+{
+    strvec additional_flags;
+    additional_flags.emplace_back("-c");
+    if (compiler == Compiler::MSVC)
+    {
+        if (!pch.buf.empty()) unsupported_msvc_pch();
+        additional_flags.emplace_back("-Fo:" + output.buf);
+    }
+    else
+    {
+        additional_flags.emplace_back("-o");
+        additional_flags.emplace_back(output.buf);
+        additional_flags.emplace_back("-MMD");
+        additional_flags.emplace_back("-MF");
+        additional_flags.emplace_back(output.buf + ".d");
+
+        if (!pch.buf.empty())
+        {
+            std::string pch_file = pch_path().buf;
+            if (compiler == Compiler::CLANG || compiler == Compiler::CLANGXX)
+            {
+                additional_flags.emplace_back("-include-pch");
+                additional_flags.emplace_back(pch_file);
+            }
+            else
+            {
+                // GCC picks up foo.h.gch for -include foo.h, even when
+                // foo.h itself only exists elsewhere.
+                const std::string ext = ".gch";
+                if (pch_file.size() > ext.size() &&
+                    pch_file.compare(pch_file.size() - ext.size(), ext.size(), ext) == 0)
+                    pch_file.resize(pch_file.size() - ext.size());
+                additional_flags.emplace_back("-Winvalid-pch");
+                additional_flags.emplace_back("-include");
+                additional_flags.emplace_back(pch_file);
+            }
+        }
+    }
+    return this->cmd({source}, additional_flags);
+}
+
+target::Target CompileOptions::obj_target(const os::path &output, const os::path &source) const
+{
+    target::Target target(output, obj_cmd(output, source), {source});
+    target.source = source;
+    // TODO: dependencies from /showIncludes for MSVC
+    if (compiler != Compiler::MSVC)
+        target.depfile = output.buf + ".d";
+    if (!pch.buf.empty())
+        target.dependencies.push_back(pch_path());
+    return target;
+}
+
+os::path CompileOptions::pch_path() const
+{
+    if (!pch_output.buf.empty()) return pch_output;
+    bool clang = compiler == Compiler::CLANG || compiler == Compiler::CLANGXX;
+    // include/common.h becomes pch_dir/include_common.h.gch, so headers with
+    // the same name in different directories do not collide.
+    std::string name = pch.buf;
+    std::replace(name.begin(), name.end(), '/', '_');
+    std::replace(name.begin(), name.end(), '\\', '_');
+    return pch_dir / (name + (clang ? ".pch" : ".gch"));
+}
+
+os::Cmd CompileOptions::pch_cmd() const
+{
+    if (compiler == Compiler::MSVC) unsupported_msvc_pch();
+
+    bool c = compiler == Compiler::CC || compiler == Compiler::GCC || compiler == Compiler::CLANG;
+    os::path output = pch_path();
+    strvec additional_flags{"-x", c ? "c-header" : "c++-header", "-c", "-o", output.buf,
+                            "-MMD", "-MF", output.buf + ".d"};
+    return this->cmd({pch}, additional_flags);
+}
+
+// Objects made by obj_target depend on this target, so changing the header
+// or anything it includes rebuilds the PCH and then every object.
+target::Target CompileOptions::pch_target() const
+{
+    os::Cmd cmd = pch_cmd();
+    if (pch_output.buf.empty()) os::make_directory_if_not_exists(pch_dir);
+    os::path output = pch_path();
+    target::Target target(output, cmd, {pch});
+    target.source = pch;
+    target.depfile = output.buf + ".d";
+    return target;
+}
+
+// Generates build_dir/<name>_N.cpp for the sources, inserts object targets
+// for them and for excluded sources, and returns the objects to link.
+os::pathvec CompileOptions::unity_targets(target::TargetMap &targets, const os::path &build_dir,
+                                          const os::pathvec &sources, const UnityBuild &unity) const
+{
+    bool c = compiler == Compiler::CC || compiler == Compiler::GCC || compiler == Compiler::CLANG;
+    os::pathvec objects;
+    std::vector<os::pathvec> batches;
+    uint64_t batch_bytes = 0;
+
+    for (const auto &source : sources)
+    {
+        auto excluded = std::find_if(unity.exclude.begin(), unity.exclude.end(),
+                                     [&](const os::path &p) { return p.buf == source.buf; });
+        if (excluded != unity.exclude.end())
+        {
+            size_t slash = source.buf.find_last_of("/\\");
+            std::string name = slash == std::string::npos ? source.buf : source.buf.substr(slash + 1);
+            os::path object = build_dir / str::change_extension(name, "o");
+            target::Target target = obj_target(object, source);
+            targets.insert(target);
+            objects.push_back(object);
+            continue;
+        }
+
+        uint64_t size = os::stat_file(source).size;
+        bool full = !batches.empty() &&
+                    ((unity.batch_size > 0 && batches.back().size() >= unity.batch_size) ||
+                     (unity.batch_bytes > 0 && batch_bytes + size > unity.batch_bytes));
+        if (batches.empty() || full)
+        {
+            batches.emplace_back();
+            batch_bytes = 0;
+        }
+        batches.back().push_back(source);
+        batch_bytes += size;
+    }
+
+    for (size_t i = 0; i < batches.size(); i++)
+    {
+        std::string name = unity.name + "_" + std::to_string(i);
+        os::path unity_source = build_dir / (name + (c ? ".c" : ".cpp"));
+        os::path object = build_dir / (name + ".o");
+        if (targets.targets.find(object.buf) != targets.targets.end())
+        {
+            // Another call with the same build_dir and name would share the file.
+            log::error(object.buf + " is already a target, give the UnityBuild another name");
+            // TODO: Error
+            throw target::BUILD_DUPLICATE_TARGET_ERROR;
+        }
+
+        // The includes are absolute since the unity file lives in build_dir.
+        std::string content;
+        for (const auto &source : batches[i])
+            content += "#include \"" + os::absolute(source).buf + "\"\n";
+
+        // Rewriting an unchanged file would rebuild the whole batch.
+        std::string old_content;
+        if (!os::read_file(unity_source, old_content) || old_content != content)
+        {
+            // TODO: Error
+            if (!os::write_file(unity_source, content)) throw os::FILE_WRITE_ERROR;
+        }
+
+        target::Target target = obj_target(object, unity_source);
+        targets.insert(target);
+        objects.push_back(object);
+    }
+
+    return objects;
+}
+
+os::Cmd CompileOptions::static_lib_cmd(const os::path &output, const os::pathvec &objects) const
+{
+    os::Cmd cmd({"ar", "r", output.buf});
+    cmd.append_many(os::paths_to_strs(objects));
+    return cmd;
+}
+} // namespace c
+
+namespace wget {
+void make_available(const os::path &path, const std::string &url, WgetBackend backend) {
+    if (exists(path)) return;
+
+    switch (backend) {
+        case WgetBackend::Wget: {
+            TODO("download with Curl");
+        } break;
+
+        case WgetBackend::Curl: {
+            auto cmd = os::Cmd({"curl", "-L", "-o", path.buf, url});
+            cmd.run();
+        } break;
+
+        case WgetBackend::PowerShell: {
+            TODO("download with PowerShell");
+        } break;
+    }
+}
+} // namespace wget
+
+namespace vcpkg {
+std::string TargetTriplet::to_string() const {
+    return triplet;
+}
+
+Vcpkg::Vcpkg() : root("vcpkg_installed") {}
+
+Vcpkg &Vcpkg::with_triplet(const std::string &triplet) {
+    bool is_static = triplet.find("-static") != std::string::npos;
+    this->triplet = TargetTriplet { triplet, is_static };
+    return *this;
+}
+
+Vcpkg &Vcpkg::with_root(const nbs::os::path &path) {
+    this->root = path;
+    return *this;
+}
+
+nbs::os::pathvec Vcpkg::include_paths() const {
+    return { root / triplet.to_string() / "include" };
+}
+
+nbs::os::pathvec Vcpkg::library_paths() const {
+    return { root / triplet.to_string() / "lib" };
+}
+
+void Vcpkg::install() const {
+    nbs::os::Cmd({
+        "vcpkg", "install",
+        "--triplet=" + triplet.to_string(),
+        "--vcpkg-root=" + root.buf,
+    }).run();
+}
+} // namespace vcpkg
+
+#if __cpp_impl_coroutine
+namespace async
+{
+void EventLoop::schedule(std::coroutine_handle<> handle)
+{
+    ready.push(handle);
+}
+
+bool EventLoop::run_one()
+{
+    if (!ready.empty())
+    {
+        std::coroutine_handle<> handle = ready.front();
+        ready.pop();
+        handle.resume();
+        return true;
+    }
+    if (group.empty()) return false;
+
+    os::ProcessStatus status = group.wait_any();
+    auto it = std::find_if(waiting.begin(), waiting.end(), [&](const std::pair<os::Process, CmdAwaiter *> &entry) {
+        return entry.first == status.process;
+    });
+    CmdAwaiter *awaiter = it->second;
+    waiting.erase(it);
+    awaiter->status = std::move(status);
+    awaiter->handle.resume();
+    return true;
+}
+
+NBSAPI EventLoop &event_loop()
+{
+    static EventLoop loop;
+    return loop;
+}
+
+bool CmdAwaiter::await_ready() const noexcept
+{
+    return false;
+}
+
+// A spawn error propagates out of the co_await.
+void CmdAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    os::Process process = cmd.run_async(capture);
+    this->handle = handle;
+    EventLoop &loop = event_loop();
+    loop.group.add(process);
+    loop.waiting.emplace_back(process, this);
+}
+
+os::ProcessStatus CmdAwaiter::await_resume()
+{
+    if (!status->success())
+    {
+        log::error("Command failed: " + cmd.to_string());
+        if (!status->output.empty()) std::cerr << status->output << std::flush;
+        // TODO: Error
+        throw os::PROCESS_EXIT_STATUS_ERROR;
+    }
+    return std::move(*status);
+}
+
+bool TaskPromiseBase::FinalAwaiter::await_ready() const noexcept
+{
+    return false;
+}
+
+std::coroutine_handle<> TaskPromiseBase::FinalAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    if (promise->on_done) promise->on_done();
+    std::coroutine_handle<> next = promise->continuation;
+    if (promise->detached) handle.destroy();
+    if (next) return next;
+    return std::noop_coroutine();
+}
+
+void TaskPromiseBase::FinalAwaiter::await_resume() const noexcept
+{
+}
+
+std::suspend_always TaskPromiseBase::initial_suspend() noexcept
+{
+    return {};
+}
+
+TaskPromiseBase::FinalAwaiter TaskPromiseBase::final_suspend() noexcept
+{
+    return FinalAwaiter{this};
+}
+
+void TaskPromiseBase::unhandled_exception()
+{
+    error = std::current_exception();
+}
+
+void TaskPromise<void>::return_void()
+{
+}
+
+void TaskPromise<void>::result()
+{
+    if (error) std::rethrow_exception(error);
+}
+
+void Join::arrive(size_t index)
+{
+    if (!arrived) first = index;
+    arrived = true;
+    if (remaining == 0) return;
+    if (--remaining == 0 && continuation) event_loop().schedule(continuation);
+}
+
+Join::Awaiter Join::operator co_await() noexcept
+{
+    return Awaiter{this};
+}
+
+bool Join::Awaiter::await_ready() const noexcept
+{
+    return join->remaining == 0;
+}
+
+void Join::Awaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    join->continuation = handle;
+}
+
+void Join::Awaiter::await_resume() const noexcept
+{
+}
+
+NBSAPI Task<void> when_all(std::vector<Task<void>> tasks)
+{
+    auto join = std::make_shared<Join>();
+    join->remaining = tasks.size();
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        tasks[i].start([join, i] { join->arrive(i); });
+    }
+    co_await *join;
+
+    for (auto &task : tasks)
+    {
+        task.result();
+    }
+}
+} // namespace async
+#endif
+} // namespace nbs
+
+#endif // NBS_IMPLEMENTATION
+#endif // NBS_HPP
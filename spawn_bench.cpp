@@ -0,0 +1,44 @@
+#include <chrono>
+#define NBS_IMPLEMENTATION
+#include "nbs.hpp"
+
+using namespace nbs;
+
+// Measures how many processes per second Cmd::run_async can start with each
+// spawn backend. Pass a heap size in MiB to see how the fork path degrades
+// when the build driver itself is large.
+//
+//   c++ -O2 spawn_bench.cpp -o spawn_bench && ./spawn_bench 1000 512
+
+double spawns_per_second(os::SpawnBackend backend, size_t count)
+{
+    os::set_spawn_backend(backend);
+    os::Cmd cmd("true");
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        cmd.run();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return count / elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 1000;
+    size_t heap_mib = argc > 2 ? std::stoul(argv[2]) : 0;
+
+    std::vector<char> heap(heap_mib * 1024 * 1024, 1);
+
+    log::minimal_level = log::Warning;
+    double fork = spawns_per_second(os::SpawnBackend::Fork, count);
+    double spawn = spawns_per_second(os::SpawnBackend::PosixSpawn, count);
+    log::minimal_level = log::Info;
+
+    log::info("heap: " + std::to_string(heap_mib) + " MiB, " + std::to_string(count) + " spawns");
+    log::info("fork + execvp: " + std::to_string((size_t)fork) + " spawns/s");
+    log::info("posix_spawnp:  " + std::to_string((size_t)spawn) + " spawns/s");
+    return 0;
+}